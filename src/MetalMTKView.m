@@ -91,8 +91,6 @@ extern void TraceRay(float x, float y);
           mesh_data->raytracing_divs_x = 10 * mesh_data->width / (float) (mesh_data->height);
           mesh_data->raytracing_divs_y = 10;
         }
-        mesh_data->raytracing_x = 0;
-        mesh_data->raytracing_y = 0;
       }
       break;
     }
@@ -19,18 +19,15 @@ extern MeshData *mesh_data;
 
 extern void PackMesh();
 extern void Load();
-extern bool DrawPixel();
+extern bool DrawTiles();
 extern void RadiosityIterate();
 
 void myCFTimerCallback()
 {
   if (mesh_data->raytracing_animation) {
-    // draw 100 pixels and then refresh the screen and handle any user input
-    for (int i = 0; i < 100; i++) {
-      if (!DrawPixel()) {
-        mesh_data->raytracing_animation = false;
-        break;
-      }
+    // draw a batch of tiles and then refresh the screen and handle any user input
+    if (!DrawTiles()) {
+      mesh_data->raytracing_animation = false;
     }
     PackMesh();
     [GLOBAL_renderer reGenerate];
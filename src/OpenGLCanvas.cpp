@@ -221,8 +221,6 @@ void OpenGLCanvas::keyboardCB(GLFWwindow* window, int key, int scancode, int act
           mesh_data->raytracing_divs_x = 10 * mesh_data->width / (float) (mesh_data->height);
           mesh_data->raytracing_divs_y = 10;
         }
-        mesh_data->raytracing_x = 0;
-        mesh_data->raytracing_y = 0;
       }
       break;
     }
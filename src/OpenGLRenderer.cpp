@@ -23,7 +23,7 @@ void RadiositySubdivide();
 void RadiosityClear();
 void RaytracerClear();
 void PackMesh();
-bool DrawPixel();
+bool DrawTiles();
 }
 
 // ==================================================================
@@ -50,13 +50,10 @@ void convert(glm::mat4 &a, const Matrix &b) {
 
 void Animate() {
   if (GLOBAL_args->mesh_data->raytracing_animation) {
-    // draw 100 pixels and then refresh the screen and handle any user input
-    for (int i = 0; i < 10000; i++) {
-      if(GLOBAL_args->debug && (i + 1) % 100 == 0) std::cout << i + 1 << std::endl;
-      if (!DrawPixel()) {
-        GLOBAL_args->mesh_data->raytracing_animation = false;
-        break;
-      }
+    // draw a batch of tiles (on all of the cores) and then refresh the
+    // screen and handle any user input
+    if (!DrawTiles()) {
+      GLOBAL_args->mesh_data->raytracing_animation = false;
     }
     PackMesh();
   }
@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 #include "mesh.h"
 #include "raytracer.h"
@@ -23,6 +24,7 @@
 
 
 ArgParser *GLOBAL_args;
+thread_local RandomGenerator ArgParser::random_generator;
 
 // ================================================================
 
@@ -30,12 +32,13 @@ void ArgParser::DefaultValues() {
   // BASIC RENDERING PARAMETERS
   input_file = "";
   path = "";
+  output_file = "";
+  batch_render = "raytrace";
+  photon_map_cache = "";
   mesh_data->width = 500;
   mesh_data->height = 500;
   mesh_data->raytracing_divs_x = 1;
   mesh_data->raytracing_divs_y = 1;
-  mesh_data->raytracing_x = 0;
-  mesh_data->raytracing_y = 0;
   mesh_data->raytracing_animation = false;
   mesh_data->radiosity_animation = false;
   
@@ -50,11 +53,24 @@ void ArgParser::DefaultValues() {
   
   // RAYTRACING PARAMETERS
   mesh_data->num_bounces = 0;
+  mesh_data->russian_roulette_threshold = 0;
+  mesh_data->contribution_cutoff = 0;
   mesh_data->num_shadow_samples = 0;
   mesh_data->num_antialias_samples = 1;
   mesh_data->num_glossy_samples = 1;
   mesh_data->ambient_light = {0.1f,0.1f,0.1f};
   mesh_data->intersect_backfacing = false;
+  mesh_data->use_bvh = true;
+  mesh_data->use_packets = true;
+  mesh_data->num_threads = 0;
+  mesh_data->progressive_samples = 16;
+  mesh_data->shuffle_light_strata = true;
+  mesh_data->light_sampling = LIGHT_SAMPLING_ALL;
+  mesh_data->adaptive_min_samples = 4;
+  mesh_data->adaptive_max_samples = 0;
+  mesh_data->antialias_threshold = 0.01;
+  mesh_data->sample_budget = 0;
+  mesh_data->time_budget = 0;
   
   //PORTAL PARAMETERS
   mesh_data->portal_recursion_depth = 0;
@@ -66,7 +82,15 @@ void ArgParser::DefaultValues() {
   mesh_data->render_kdtree = false;
   mesh_data->num_photons_to_shoot = 10000;
   mesh_data->num_photons_to_collect = 100;
+  mesh_data->photon_max_radius = 0;
+  mesh_data->photon_filter = PHOTON_FILTER_BOX;
+  mesh_data->num_caustic_photons_to_shoot = 0;
+  mesh_data->sppm_passes = 16;
+  mesh_data->sppm_initial_radius = 0;
+  mesh_data->num_caustic_photons_to_collect = 25;
+  mesh_data->use_projection_maps = true;
   mesh_data->gather_indirect = false;
+  mesh_data->irradiance_cache_accuracy = 0;
 
   // RENDERING GEOMETRY
   mesh_data->meshTriCount = 0;
@@ -78,6 +102,8 @@ void ArgParser::DefaultValues() {
   
   gloss = false;
   debug = false;
+  verbose = false;
+  seed = 37;
 }
 
 
@@ -95,6 +121,17 @@ ArgParser::ArgParser(int argc, const char *argv[], MeshData *_mesh_data) {
         std::string(argv[i]) == std::string("-i")) {
       i++; assert (i < argc); 
       separatePathAndFile(argv[i],path,input_file);
+    } else if (std::string(argv[i]) == std::string("-output")) {
+      i++; assert (i < argc);
+      output_file = argv[i];
+    } else if (std::string(argv[i]) == std::string("-render")) {
+      i++; assert (i < argc);
+      batch_render = argv[i];
+      if (batch_render != "raytrace" && batch_render != "photon" && batch_render != "sppm") {
+        std::cout << "ERROR: unknown render mode '" << batch_render
+                  << "' (expected raytrace, photon or sppm)" << std::endl;
+        exit(1);
+      }
     } else if (std::string(argv[i]) == std::string("-size")) {
       i++; assert (i < argc); 
       mesh_data->width = atoi(argv[i]);
@@ -116,6 +153,17 @@ ArgParser::ArgParser(int argc, const char *argv[], MeshData *_mesh_data) {
     } else if (std::string(argv[i]) == std::string("-num_bounces")) {
       i++; assert (i < argc); 
       mesh_data->num_bounces = atoi(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-russian_roulette")) {
+      // continue the reflected & portal rays of paths whose throughput
+      // is below the threshold with probability throughput / threshold
+      i++; assert (i < argc);
+      mesh_data->russian_roulette_threshold = atof(argv[i]);
+      assert (mesh_data->russian_roulette_threshold >= 0);
+    } else if (std::string(argv[i]) == std::string("-contribution_cutoff")) {
+      // don't continue paths whose throughput is below the cutoff (biased)
+      i++; assert (i < argc);
+      mesh_data->contribution_cutoff = atof(argv[i]);
+      assert (mesh_data->contribution_cutoff >= 0);
     } else if (std::string(argv[i]) == std::string("-num_shadow_samples")) {
       i++; assert (i < argc); 
       mesh_data->num_shadow_samples = atoi(argv[i]);
@@ -123,6 +171,40 @@ ArgParser::ArgParser(int argc, const char *argv[], MeshData *_mesh_data) {
       i++; assert (i < argc); 
       mesh_data->num_antialias_samples = atoi(argv[i]);
       assert (mesh_data->num_antialias_samples > 0);
+    } else if (std::string(argv[i]) == std::string("-no_shuffle_light_strata")) {
+      // visit the strata of the lights in the same order everywhere
+      mesh_data->shuffle_light_strata = false;
+    } else if (std::string(argv[i]) == std::string("-light_sampling")) {
+      // all, power or tree
+      i++; assert (i < argc);
+      if (std::string(argv[i]) == std::string("all")) {
+        mesh_data->light_sampling = LIGHT_SAMPLING_ALL;
+      } else if (std::string(argv[i]) == std::string("power")) {
+        mesh_data->light_sampling = LIGHT_SAMPLING_POWER;
+      } else if (std::string(argv[i]) == std::string("tree")) {
+        mesh_data->light_sampling = LIGHT_SAMPLING_TREE;
+      } else {
+        std::cout << "ERROR: unknown light sampling '" << argv[i] << "'" << std::endl;
+        exit(1);
+      }
+    } else if (std::string(argv[i]) == std::string("-adaptive_antialias")) {
+      // start every pixel with min samples, add more (up to max) to
+      // the pixels that are still noisy
+      i++; assert (i < argc);
+      mesh_data->adaptive_min_samples = atoi(argv[i]);
+      i++; assert (i < argc);
+      mesh_data->adaptive_max_samples = atoi(argv[i]);
+      assert (mesh_data->adaptive_min_samples >= 2);
+      assert (mesh_data->adaptive_max_samples >= mesh_data->adaptive_min_samples);
+    } else if (std::string(argv[i]) == std::string("-antialias_threshold")) {
+      i++; assert (i < argc);
+      mesh_data->antialias_threshold = atof(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-sample_budget")) {
+      i++; assert (i < argc);
+      mesh_data->sample_budget = atof(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-time_budget")) {
+      i++; assert (i < argc);
+      mesh_data->time_budget = atof(argv[i]);
     } else if (std::string(argv[i]) == std::string("-num_glossy_samples")) {
       i++; assert (i < argc); 
       mesh_data->num_glossy_samples = atoi(argv[i]);
@@ -141,12 +223,76 @@ ArgParser::ArgParser(int argc, const char *argv[], MeshData *_mesh_data) {
     } else if (std::string(argv[i]) == std::string("-num_photons_to_collect")) {
       i++; assert (i < argc);
       mesh_data->num_photons_to_collect = atoi(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-num_caustic_photons_to_shoot")) {
+      i++; assert (i < argc);
+      mesh_data->num_caustic_photons_to_shoot = atoi(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-num_caustic_photons_to_collect")) {
+      i++; assert (i < argc);
+      mesh_data->num_caustic_photons_to_collect = atoi(argv[i]);
+    } else if (std::string(argv[i]) == std::string("-no_projection_maps")) {
+      // emit the caustic photons in every direction, for comparison
+      mesh_data->use_projection_maps = false;
+    } else if (std::string(argv[i]) == std::string("-sppm_passes")) {
+      i++; assert (i < argc);
+      mesh_data->sppm_passes = atoi(argv[i]);
+      assert (mesh_data->sppm_passes >= 1);
+    } else if (std::string(argv[i]) == std::string("-sppm_initial_radius")) {
+      i++; assert (i < argc);
+      mesh_data->sppm_initial_radius = atof(argv[i]);
+      assert (mesh_data->sppm_initial_radius >= 0);
+    } else if (std::string(argv[i]) == std::string("-photon_map_cache")) {
+      // a directory for the traced photon maps, reused while the scene
+      // & the photon parameters don't change
+      i++; assert (i < argc);
+      photon_map_cache = argv[i];
+    } else if (std::string(argv[i]) == std::string("-photon_max_radius")) {
+      i++; assert (i < argc);
+      mesh_data->photon_max_radius = atof(argv[i]);
+      assert (mesh_data->photon_max_radius >= 0);
+    } else if (std::string(argv[i]) == std::string("-photon_filter")) {
+      // box, cone or epanechnikov
+      i++; assert (i < argc);
+      if (std::string(argv[i]) == std::string("box")) {
+        mesh_data->photon_filter = PHOTON_FILTER_BOX;
+      } else if (std::string(argv[i]) == std::string("cone")) {
+        mesh_data->photon_filter = PHOTON_FILTER_CONE;
+      } else if (std::string(argv[i]) == std::string("epanechnikov")) {
+        mesh_data->photon_filter = PHOTON_FILTER_EPANECHNIKOV;
+      } else {
+        std::cout << "ERROR: unknown photon filter '" << argv[i] << "'" << std::endl;
+        exit(1);
+      }
     } else if (std::string(argv[i]) == std::string("-gather_indirect")) {
       mesh_data->gather_indirect = true;
+    } else if (std::string(argv[i]) == std::string("-irradiance_cache")) {
+      // smaller values place the records closer together
+      i++; assert (i < argc);
+      mesh_data->irradiance_cache_accuracy = atof(argv[i]);
+      assert (mesh_data->irradiance_cache_accuracy >= 0);
+    } else if (std::string(argv[i]) == std::string("-no_bvh")) {
+      // brute force ray casting, for comparison with the BVH
+      mesh_data->use_bvh = false;
+    } else if (std::string(argv[i]) == std::string("-no_packets")) {
+      // trace the primary rays one at a time
+      mesh_data->use_packets = false;
+    } else if (std::string(argv[i]) == std::string("-num_threads")) {
+      // 0 = use all of the cores
+      i++; assert (i < argc);
+      mesh_data->num_threads = atoi(argv[i]);
+      assert (mesh_data->num_threads >= 0);
+    } else if (std::string(argv[i]) == std::string("-progressive_samples")) {
+      // samples per pixel the interactive display accumulates
+      i++; assert (i < argc);
+      mesh_data->progressive_samples = atoi(argv[i]);
     } else if (std::string(argv[i]) == std::string("-gloss")) {
       gloss = true;
+    } else if (std::string(argv[i]) == std::string("-seed")) {
+      i++; assert (i < argc);
+      seed = atoi(argv[i]);
     } else if (std::string(argv[i]) == std::string("-debug")) {
       debug = true;
+    } else if (std::string(argv[i]) == std::string("-verbose")) {
+      verbose = true;
     } else if (std::string(argv[i]) == std::string("-portal_recursion_depth")) {
       i++; assert (i < argc); 
       mesh_data->portal_recursion_depth = atoi(argv[i]);
@@ -170,10 +316,13 @@ ArgParser::ArgParser(int argc, const char *argv[], MeshData *_mesh_data) {
   photon_mapping = NULL;
   mesh = NULL;
   
+  SeedRandom(RANDOM_STREAM_DEFAULT,0);
   Load();
   GLOBAL_args = this;
-  packMesh(mesh_data,raytracer,radiosity,photon_mapping);
-  raytracer->Init();
+  // (batch mode never touches OpenGL)
+  if (output_file == "") {
+    packMesh(mesh_data,raytracer,radiosity,photon_mapping);
+  }
 }
 
 // ================================================================
@@ -201,6 +350,15 @@ void ArgParser::Load() {
 
 // ================================================================
 
+int ArgParser::numThreads() const {
+  if (mesh_data->num_threads > 0) return mesh_data->num_threads;
+  int n = std::thread::hardware_concurrency();
+  if (n < 1) n = 1;
+  return n;
+}
+
+// ================================================================
+
 void ArgParser::separatePathAndFile(const std::string &input, std::string &path, std::string &file) {
   // we need to separate the filename from the path
   // (we assume the vertex & fragment shaders are in the same directory)
@@ -6,7 +6,7 @@
 #define __ARG_PARSER_H__
 
 #include <string>
-#include <random>
+#include "random.h"
 
 class MeshData;
 class Mesh;
@@ -27,18 +27,18 @@ public:
   ArgParser(int argc, const char *argv[], MeshData *_mesh_data);
 
   
-  double rand() {
-#if 1
-    // random seed
-    static std::random_device rd;    
-    static std::mt19937 engine(rd());
-#else
-    // deterministic randomness
-    static std::mt19937 engine(37);
-#endif
-    static std::uniform_real_distribution<double> dist(0.0, 1.0);
-    return dist(engine);
-  }
+  // random real in [0,1), from the calling thread's generator
+  double rand() { return random_generator.Uniform(); }
+  // restart the calling thread's generator, e.g., at the start of
+  // each pixel, so the result doesn't depend on the thread count
+  void SeedRandom(RANDOM_STREAM domain, uint64_t index) {
+    random_generator.Seed(seed, domain, index); }
+  // save & restore the state of the calling thread's generator
+  RandomGenerator getRandomGenerator() const { return random_generator; }
+  void setRandomGenerator(const RandomGenerator &g) { random_generator = g; }
+
+  // the -num_threads setting (0 = all of the cores)
+  int numThreads() const;
 
   // helper functions
   void separatePathAndFile(const std::string &input, std::string &path, std::string &file);
@@ -53,6 +53,13 @@ public:
   std::string input_file;
   std::string path;
 
+  // batch mode (no window): render the image & save it to this file
+  std::string output_file;
+  std::string batch_render;  // "raytrace", "photon" or "sppm"
+
+  // save the photon maps in (& load them from) this directory
+  std::string photon_map_cache;
+
   Mesh *mesh;
   MeshData *mesh_data;
   RayTracer *raytracer;
@@ -61,6 +68,13 @@ public:
   BoundingBox *bbox;
   bool gloss;
   bool debug;
+  // print the statistics of the acceleration structures as they're built
+  bool verbose;
+  unsigned int seed;
+
+private:
+  // one generator per thread (the image is rendered in parallel)
+  static thread_local RandomGenerator random_generator;
 
 };
 
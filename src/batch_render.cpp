@@ -0,0 +1,58 @@
+#include <iostream>
+#include <chrono>
+
+#include "batch_render.h"
+#include "argparser.h"
+#include "meshdata.h"
+#include "raytracer.h"
+#include "photon_mapping.h"
+#include "tile_renderer.h"
+#include "progressive_photon_mapping.h"
+#include "image.h"
+
+// ====================================================================
+
+static double SecondsSince(const std::chrono::steady_clock::time_point &start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int BatchRender(ArgParser *args) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  RayTracer::ResetRayCount();
+
+  if (args->batch_render == "photon") {
+    // trace the photons first, then use them for the indirect light
+    std::chrono::steady_clock::time_point photon_start = std::chrono::steady_clock::now();
+    args->photon_mapping->TracePhotons();
+    std::cout << "traced " << args->mesh_data->num_photons_to_shoot << " photons in "
+              << SecondsSince(photon_start) << " seconds" << std::endl;
+    args->mesh_data->gather_indirect = true;
+  } else {
+    args->mesh_data->gather_indirect = false;
+  }
+
+  TileRenderer *tiles = args->raytracer->getTileRenderer();
+  Image image;
+  if (args->batch_render == "sppm") {
+    // the photons are traced in passes, as the image is rendered
+    ProgressivePhotonMapping sppm(args);
+    sppm.RenderImage(image);
+  } else {
+    tiles->RenderImage(image);
+  }
+  if (!image.Save(args->output_file)) {
+    return 1;
+  }
+
+  double seconds = SecondsSince(start);
+  unsigned long long rays = RayTracer::numRaysCast();
+  std::cout << "rendered " << args->mesh_data->width << "x" << args->mesh_data->height
+            << " (" << args->batch_render << ", " << args->numThreads() << " threads) to "
+            << args->output_file << std::endl;
+  std::cout << "wall time " << seconds << " seconds, " << rays << " rays, "
+            << rays / seconds << " rays/second" << std::endl;
+  return 0;
+}
+
+// ====================================================================
+// ====================================================================
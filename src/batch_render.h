@@ -0,0 +1,17 @@
+#ifndef _BATCH_RENDER_H_
+#define _BATCH_RENDER_H_
+
+class ArgParser;
+
+// ====================================================================
+// Headless rendering, for machines without a display: render the
+// whole image at full resolution (ray tracing, or ray tracing with
+// photon mapped or progressively photon mapped indirect light), save
+// it to args->output_file and report the timing.  Returns the exit
+// code for main.
+
+int BatchRender(ArgParser *args);
+
+// ====================================================================
+
+#endif
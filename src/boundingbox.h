@@ -45,6 +45,12 @@ public:
     double z = maximum.z() - minimum.z();
     return mymax(x,mymax(y,z));
   }
+  double SurfaceArea() const {
+    double x = maximum.x() - minimum.x();
+    double y = maximum.y() - minimum.y();
+    double z = maximum.z() - minimum.z();
+    return 2 * (x*y + y*z + z*x);
+  }
 
   // =========
   // MODIFIERS
@@ -0,0 +1,637 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "primitive.h"
+#include "portal.h"
+#include "ray.h"
+#include "hit.h"
+#include "sphere.h"
+#include "scene_snapshot.h"
+#include "utils.h"
+
+#define BVH_NUM_BINS 16
+#define BVH_MIN_ITEMS_IN_LEAF 2
+#define BVH_MAX_ITEMS_IN_LEAF 8
+#define BVH_MAX_DEPTH 48
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECTION_COST 1.0
+// the single precision packet tests only reject a ray if it misses by
+// at least this much (relative to the distances involved)
+#define BVH_PACKET_MARGIN 0.001f
+
+// ==================================================================
+// HELPER FUNCTIONS
+
+static inline double axisValue(const Vec3f &v, int axis) {
+  return axis == 0 ? v.x() : (axis == 1 ? v.y() : v.z());
+}
+
+// slab test against the box, only the interval [0,tmax] of the ray is
+// of interest.  Division by a zero direction component produces an
+// infinity, which the comparisons below handle correctly.
+static inline bool RayOverlapsBox(const BoundingBox &bb, const double orig[3],
+                                  const double inv_dir[3], double tmax) {
+  double t0 = 0;
+  double t1 = tmax;
+  for (int a = 0; a < 3; a++) {
+    double tnear = (axisValue(bb.getMin(),a) - orig[a]) * inv_dir[a];
+    double tfar  = (axisValue(bb.getMax(),a) - orig[a]) * inv_dir[a];
+    if (tnear > tfar) std::swap(tnear,tfar);
+    if (tnear > t0) t0 = tnear;
+    if (tfar < t1) t1 = tfar;
+    if (t0 > t1) return false;
+  }
+  return true;
+}
+
+// the order the objects are tested in by the brute force loop
+static inline bool BeforeInListOrder(const BVHItem &a, const BVHItem &b) {
+  if (a.type != b.type) return a.type < b.type;
+  return a.index < b.index;
+}
+
+// the position of a quad in the scene snapshot
+int BVH::QuadIndex(const BVHItem &item) const {
+  assert (item.type == BVH_ORIGINAL_QUAD || item.type == BVH_RASTERIZED_FACE);
+  if (item.type == BVH_ORIGINAL_QUAD) return item.index;
+  return snapshot->RasterizedFaceIndex(item.index);
+}
+
+BoundingBox BVH::ItemBoundingBox(const BVHItem &item) const {
+  BoundingBox answer;
+  if (item.type == BVH_PRIMITIVE) {
+    answer = mesh->getPrimitive(item.index)->getBoundingBox();
+  } else if (item.type == BVH_PORTAL_SIDE) {
+    // PortalSide::intersectRay uses the plane through the centroid
+    // perpendicular to the normal, which differs from the plane of
+    // the corners if the transform shears (non uniform scale applied
+    // after rotation).  Slide the corners along the local z axis onto
+    // that plane so the box bounds what can actually be hit.
+    const PortalSide &side = mesh->getPortalSide(item.index);
+    Vec3f corners[4];
+    side.getCorners(corners[0],corners[1],corners[2],corners[3]);
+    Vec3f z_axis(0,0,1);
+    side.getTransform().TransformDirection(z_axis);
+    double denom = side.getNormal().Dot3(z_axis);
+    for (int i = 0; i < 4 && fabs(denom) > 0; i++) {
+      double z = side.getNormal().Dot3(side.getCentroid()-corners[i]) / denom;
+      corners[i] += z*z_axis;
+    }
+    Vec3f a = corners[0], b = corners[1], c = corners[2], d = corners[3];
+    answer = BoundingBox(a);
+    answer.Extend(b);
+    answer.Extend(c);
+    answer.Extend(d);
+  } else {
+    // bound the (rounded) corners that are actually intersected
+    double p[3];
+    int quad = QuadIndex(item);
+    snapshot->getCorner(quad,0,p);
+    answer = BoundingBox(Vec3f(p[0],p[1],p[2]));
+    for (int j = 1; j < 4; j++) {
+      snapshot->getCorner(quad,j,p);
+      answer.Extend(Vec3f(p[0],p[1],p[2]));
+    }
+  }
+  // give the axis aligned (flat) quads a little thickness
+  Vec3f pad(EPSILON,EPSILON,EPSILON);
+  return BoundingBox(answer.getMin()-pad,answer.getMax()+pad);
+}
+
+// ==================================================================
+// CONSTRUCTION
+
+void BVH::Build(const Mesh *m) {
+  std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+  mesh = m;
+  snapshot = mesh->getSnapshot();
+  assert (snapshot != NULL);
+  nodes.clear();
+  items.clear();
+  num_leaves = 0;
+
+  // gather everything that can be hit by a ray
+  std::vector<BVHItem> all;
+  for (int i = 0; i < mesh->numOriginalQuads(); i++) { all.push_back({BVH_ORIGINAL_QUAD,i}); }
+  for (int i = 0; i < mesh->numRasterizedPrimitiveFaces(); i++) { all.push_back({BVH_RASTERIZED_FACE,i}); }
+  for (int i = 0; i < mesh->numPrimitives(); i++) { all.push_back({BVH_PRIMITIVE,i}); }
+  for (int i = 0; i < mesh->numPortalSides(); i++) { all.push_back({BVH_PORTAL_SIDE,i}); }
+
+  std::vector<BuildRecord> records;
+  records.reserve(all.size());
+  for (unsigned int i = 0; i < all.size(); i++) {
+    BuildRecord r;
+    r.item = all[i];
+    r.bbox = ItemBoundingBox(all[i]);
+    r.bbox.getCenter(r.centroid);
+    records.push_back(r);
+  }
+
+  if (!records.empty()) {
+    nodes.reserve(2*records.size());
+    BuildRecursive(records,0,records.size(),0);
+  }
+  items.reserve(records.size());
+  for (unsigned int i = 0; i < records.size(); i++) {
+    items.push_back(records[i].item);
+  }
+
+  BuildPacketData();
+  sah_cost = ComputeSAHCost();
+  std::chrono::high_resolution_clock::time_point stop = std::chrono::high_resolution_clock::now();
+  build_time = std::chrono::duration<double>(stop-start).count();
+}
+
+int BVH::BuildRecursive(std::vector<BuildRecord> &records, int start, int end, int depth) {
+  int index = nodes.size();
+  nodes.push_back(BVHNode());
+  int count = end-start;
+
+  // bounding box of the objects and of their centroids
+  BoundingBox bbox = records[start].bbox;
+  BoundingBox centroid_bbox(records[start].centroid);
+  for (int i = start+1; i < end; i++) {
+    bbox.Extend(records[i].bbox);
+    centroid_bbox.Extend(records[i].centroid);
+  }
+  nodes[index].bbox = bbox;
+  nodes[index].axis = 0;
+
+  if (count <= BVH_MIN_ITEMS_IN_LEAF || depth >= BVH_MAX_DEPTH) {
+    nodes[index].offset = start;
+    nodes[index].count = count;
+    num_leaves++;
+    return index;
+  }
+
+  // evaluate the surface area heuristic at the bin boundaries of each axis
+  double best_cost = -1;
+  int best_axis = -1;
+  int best_bin = -1;
+  double parent_area = bbox.SurfaceArea();
+  for (int axis = 0; axis < 3; axis++) {
+    double lo = axisValue(centroid_bbox.getMin(),axis);
+    double hi = axisValue(centroid_bbox.getMax(),axis);
+    if (hi - lo <= 0) continue;
+    int bin_count[BVH_NUM_BINS] = { 0 };
+    BoundingBox bin_bbox[BVH_NUM_BINS];
+    for (int i = start; i < end; i++) {
+      int b = int(BVH_NUM_BINS * (axisValue(records[i].centroid,axis)-lo) / (hi-lo));
+      if (b >= BVH_NUM_BINS) b = BVH_NUM_BINS-1;
+      if (bin_count[b] == 0) bin_bbox[b] = records[i].bbox;
+      else bin_bbox[b].Extend(records[i].bbox);
+      bin_count[b]++;
+    }
+    // sweep from the right to get the area & count of every right side
+    double right_area[BVH_NUM_BINS];
+    int right_count[BVH_NUM_BINS];
+    BoundingBox accum;
+    int n = 0;
+    for (int b = BVH_NUM_BINS-1; b > 0; b--) {
+      if (bin_count[b] > 0) {
+        if (n == 0) accum = bin_bbox[b];
+        else accum.Extend(bin_bbox[b]);
+        n += bin_count[b];
+      }
+      right_area[b] = n > 0 ? accum.SurfaceArea() : 0;
+      right_count[b] = n;
+    }
+    // then sweep from the left and evaluate each split plane
+    n = 0;
+    for (int b = 0; b < BVH_NUM_BINS-1; b++) {
+      if (bin_count[b] > 0) {
+        if (n == 0) accum = bin_bbox[b];
+        else accum.Extend(bin_bbox[b]);
+        n += bin_count[b];
+      }
+      if (n == 0 || right_count[b+1] == 0) continue;
+      double cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST *
+        (n * accum.SurfaceArea() + right_count[b+1] * right_area[b+1]) / parent_area;
+      if (best_axis < 0 || cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  // stop if splitting is not worth it
+  double leaf_cost = BVH_INTERSECTION_COST * count;
+  if ((best_axis < 0 || best_cost >= leaf_cost) && count <= BVH_MAX_ITEMS_IN_LEAF) {
+    nodes[index].offset = start;
+    nodes[index].count = count;
+    num_leaves++;
+    return index;
+  }
+
+  int mid;
+  if (best_axis >= 0) {
+    double lo = axisValue(centroid_bbox.getMin(),best_axis);
+    double hi = axisValue(centroid_bbox.getMax(),best_axis);
+    BuildRecord *split = std::partition(&records[start], &records[0]+end, [&](const BuildRecord &r) {
+        int b = int(BVH_NUM_BINS * (axisValue(r.centroid,best_axis)-lo) / (hi-lo));
+        if (b >= BVH_NUM_BINS) b = BVH_NUM_BINS-1;
+        return b <= best_bin; });
+    mid = split - &records[0];
+  } else {
+    // all of the centroids coincide, just split the list in half
+    best_axis = 0;
+    mid = (start+end)/2;
+  }
+  assert (mid > start && mid < end);
+
+  nodes[index].axis = best_axis;
+  nodes[index].count = 0;
+  BuildRecursive(records,start,mid,depth+1);
+  int second = BuildRecursive(records,mid,end,depth+1);
+  nodes[index].offset = second;
+  return index;
+}
+
+// the single precision copies for the packet tests
+void BVH::BuildPacketData() {
+  packet_boxes.resize(nodes.size());
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    // round outwards
+    for (int a = 0; a < 3; a++) {
+      double lo = axisValue(nodes[i].bbox.getMin(),a);
+      double hi = axisValue(nodes[i].bbox.getMax(),a);
+      packet_boxes[i].min[a] = float(lo - BVH_PACKET_MARGIN * (fabs(lo)+1));
+      packet_boxes[i].max[a] = float(hi + BVH_PACKET_MARGIN * (fabs(hi)+1));
+    }
+  }
+  packet_items.resize(items.size());
+  for (unsigned int i = 0; i < items.size(); i++) {
+    BVHPacketItem &p = packet_items[i];
+    p.shape = BVH_PACKET_NONE;
+    p.quad = -1;
+    const BVHItem &item = items[i];
+    if (item.type == BVH_ORIGINAL_QUAD || item.type == BVH_RASTERIZED_FACE) {
+      p.shape = BVH_PACKET_QUAD;
+      p.quad = QuadIndex(item);
+    } else if (item.type == BVH_PRIMITIVE) {
+      const Sphere *sphere = dynamic_cast<const Sphere*>(mesh->getPrimitive(item.index));
+      if (sphere == NULL) continue;
+      p.shape = BVH_PACKET_SPHERE;
+      for (int a = 0; a < 3; a++) { p.center[a] = sphere->getCenter()[a]; }
+      p.radius2 = sphere->getRadius() * sphere->getRadius();
+    }
+  }
+}
+
+double BVH::ComputeSAHCost() const {
+  if (nodes.empty()) return 0;
+  double root_area = nodes[0].bbox.SurfaceArea();
+  double cost = 0;
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    double relative_area = nodes[i].bbox.SurfaceArea() / root_area;
+    if (nodes[i].count > 0) cost += relative_area * BVH_INTERSECTION_COST * nodes[i].count;
+    else cost += relative_area * BVH_TRAVERSAL_COST;
+  }
+  return cost;
+}
+
+void BVH::PrintReport() const {
+  std::cout << " bvh built: " << numNodes() << " nodes (" << numLeaves() << " leaves) over "
+            << numItems() << " objects, SAH cost " << getSAHCost()
+            << " (brute force " << BVH_INTERSECTION_COST * numItems() << "), "
+            << getBuildTime() * 1000.0 << " ms" << std::endl;
+}
+
+// ==================================================================
+// RAYTRACING
+
+// the exact test of one (non portal) object, h & closest are updated
+// if the object is hit before the current closest hit
+bool BVH::IntersectItem(const BVHItem &item, const Ray &ray, const SnapshotRay &sray, Hit &h,
+                        const BVHItem *&closest, bool use_rasterized_patches,
+                        bool intersect_backfacing) const {
+  if (item.type == BVH_RASTERIZED_FACE && !use_rasterized_patches) return false;
+  if (item.type == BVH_PRIMITIVE && use_rasterized_patches) return false;
+  // also look for hits at exactly the current distance (e.g., along
+  // shared edges) and break those ties in the order of the brute
+  // force loop, so both paths produce identical images
+  Hit temp;
+  temp.set(nextafterf(h.getT(),FLT_MAX),NULL,Vec3f(0,0,0));
+  bool hit;
+  if (item.type == BVH_PRIMITIVE) {
+    hit = mesh->getPrimitive(item.index)->intersect(ray,temp);
+  } else {
+    hit = snapshot->IntersectQuad(QuadIndex(item),sray,temp,intersect_backfacing);
+  }
+  if (!hit) return false;
+  if (temp.getT() < h.getT() ||
+      (closest != NULL && temp.getT() == h.getT() && BeforeInListOrder(item,*closest))) {
+    h = temp;
+    closest = &item;
+    return true;
+  }
+  return false;
+}
+
+bool BVH::Intersect(const Ray &ray, Hit &h, bool use_rasterized_patches,
+                    bool intersect_backfacing, int *portal_out) const {
+  if (portal_out != NULL) *portal_out = -1;
+  if (nodes.empty()) return false;
+
+  const Vec3f &o = ray.getOrigin();
+  const Vec3f &d = ray.getDirection();
+  double orig[3] = { o.x(), o.y(), o.z() };
+  double inv_dir[3] = { 1.0/d.x(), 1.0/d.y(), 1.0/d.z() };
+  SnapshotRay sray(ray);
+
+  bool answer = false;
+  // the object currently closest (NULL if the hit was passed in)
+  const BVHItem *closest = NULL;
+  // portals are tracked separately and only win if they are strictly
+  // closer than the closest object (like the brute force loop)
+  Hit portal_hit;
+  int portal_index = -1;
+
+  int todo[BVH_MAX_DEPTH+2];
+  int num_todo = 0;
+  todo[num_todo++] = 0;
+  while (num_todo > 0) {
+    int index = todo[--num_todo];
+    const BVHNode &node = nodes[index];
+    double tmax = mymin(h.getT(),portal_hit.getT());
+    if (!RayOverlapsBox(node.bbox,orig,inv_dir,tmax)) continue;
+
+    if (node.count > 0) {
+      for (int i = node.offset; i < node.offset+node.count; i++) {
+        const BVHItem &item = items[i];
+        if (item.type == BVH_PORTAL_SIDE) {
+          if (portal_out == NULL) continue;
+          Hit temp;
+          if (mesh->getPortalSide(item.index).intersectRay(ray,temp) &&
+              (temp.getT() < portal_hit.getT() ||
+               (temp.getT() == portal_hit.getT() && item.index < portal_index))) {
+            portal_hit = temp;
+            portal_index = item.index;
+          }
+          continue;
+        }
+        if (IntersectItem(item,ray,sray,h,closest,use_rasterized_patches,intersect_backfacing)) {
+          answer = true;
+        }
+      }
+    } else {
+      // visit the nearer child first
+      assert (num_todo+2 <= BVH_MAX_DEPTH+2);
+      if (axisValue(d,node.axis) >= 0) {
+        todo[num_todo++] = node.offset;
+        todo[num_todo++] = index+1;
+      } else {
+        todo[num_todo++] = index+1;
+        todo[num_todo++] = node.offset;
+      }
+    }
+  }
+
+  if (portal_index >= 0 && portal_hit.getT() < h.getT()) {
+    h = portal_hit;
+    *portal_out = portal_index;
+    answer = true;
+  }
+  return answer;
+}
+
+bool BVH::Occluded(const Ray &ray, float tmax, bool use_rasterized_patches,
+                   bool intersect_backfacing, bool include_portals) const {
+  if (nodes.empty()) return false;
+
+  const Vec3f &o = ray.getOrigin();
+  const Vec3f &d = ray.getDirection();
+  double orig[3] = { o.x(), o.y(), o.z() };
+  double inv_dir[3] = { 1.0/d.x(), 1.0/d.y(), 1.0/d.z() };
+  SnapshotRay sray(ray);
+
+  int todo[BVH_MAX_DEPTH+2];
+  int num_todo = 0;
+  todo[num_todo++] = 0;
+  while (num_todo > 0) {
+    int index = todo[--num_todo];
+    const BVHNode &node = nodes[index];
+    if (!RayOverlapsBox(node.bbox,orig,inv_dir,tmax)) continue;
+
+    if (node.count > 0) {
+      for (int i = node.offset; i < node.offset+node.count; i++) {
+        const BVHItem &item = items[i];
+        switch (item.type) {
+        case BVH_ORIGINAL_QUAD:
+          if (snapshot->OccludesQuad(item.index,sray,tmax,intersect_backfacing)) return true;
+          break;
+        case BVH_RASTERIZED_FACE:
+          if (use_rasterized_patches &&
+              snapshot->OccludesQuad(QuadIndex(item),sray,tmax,intersect_backfacing)) return true;
+          break;
+        case BVH_PRIMITIVE:
+          if (!use_rasterized_patches && mesh->getPrimitive(item.index)->occludes(ray,tmax)) return true;
+          break;
+        case BVH_PORTAL_SIDE:
+          if (include_portals && mesh->getPortalSide(item.index).occludes(ray,tmax)) return true;
+          break;
+        }
+      }
+    } else {
+      // the order doesn't matter, any blocker will do
+      assert (num_todo+2 <= BVH_MAX_DEPTH+2);
+      todo[num_todo++] = node.offset;
+      todo[num_todo++] = index+1;
+    }
+  }
+  return false;
+}
+
+// ==================================================================
+// PACKETS
+
+// Moller-Trumbore for all the rays at once, the lanes that might hit
+// the triangle (v0, v0+ea, v0+eb) (including the margin)
+static inline PacketFloat PacketTriangle(const float v0[3], const float ea[3], const float eb[3],
+                                         const PacketFloat o[3], const PacketFloat d[3]) {
+  PacketFloat e1[3], e2[3], s[3];
+  for (int i = 0; i < 3; i++) {
+    e1[i] = PacketFloat(ea[i]);
+    e2[i] = PacketFloat(eb[i]);
+    s[i] = o[i] - PacketFloat(v0[i]);
+  }
+  // p = d x e2
+  PacketFloat p0 = d[1]*e2[2] - d[2]*e2[1];
+  PacketFloat p1 = d[2]*e2[0] - d[0]*e2[2];
+  PacketFloat p2 = d[0]*e2[1] - d[1]*e2[0];
+  PacketFloat det = e1[0]*p0 + e1[1]*p1 + e1[2]*p2;
+  // q = s x e1
+  PacketFloat q0 = s[1]*e1[2] - s[2]*e1[1];
+  PacketFloat q1 = s[2]*e1[0] - s[0]*e1[2];
+  PacketFloat q2 = s[0]*e1[1] - s[1]*e1[0];
+  PacketFloat inv = PacketFloat(1.0f) / det;
+  PacketFloat u = (s[0]*p0 + s[1]*p1 + s[2]*p2) * inv;
+  PacketFloat v = (d[0]*q0 + d[1]*q1 + d[2]*q2) * inv;
+  PacketFloat lo(-BVH_PACKET_MARGIN);
+  PacketFloat hi(1+BVH_PACKET_MARGIN);
+  // nearly parallel rays are left to the exact test
+  return (Abs(det) < PacketFloat(BVH_PACKET_MARGIN)) |
+    ((u >= lo) & (v >= lo) & (u+v <= hi));
+}
+
+// the lanes (of mask) that might hit the object
+int BVH::PacketFilter(const BVHPacketItem &item, const RayPacket &packet, const float tmax[],
+                      bool intersect_backfacing) const {
+  PacketFloat o[3], d[3];
+  for (int a = 0; a < 3; a++) {
+    o[a] = PacketFloat::Load(packet.orig[a]);
+    d[a] = PacketFloat::Load(packet.dir[a]);
+  }
+  PacketFloat t_max = PacketFloat::Load(tmax);
+  t_max = t_max + PacketFloat(BVH_PACKET_MARGIN) * (t_max + PacketFloat(1));
+  PacketFloat margin(BVH_PACKET_MARGIN);
+
+  if (item.shape == BVH_PACKET_QUAD) {
+    // the distance to the plane, as in SceneSnapshot::IntersectQuad
+    const SnapshotQuad &q = snapshot->getQuad(item.quad);
+    PacketFloat denom = d[0]*PacketFloat(q.n[0]) + d[1]*PacketFloat(q.n[1]) + d[2]*PacketFloat(q.n[2]);
+    PacketFloat numer = PacketFloat(q.d) -
+      (o[0]*PacketFloat(q.n[0]) + o[1]*PacketFloat(q.n[1]) + o[2]*PacketFloat(q.n[2]));
+    PacketFloat t = numer / denom;
+    PacketFloat plane = (Abs(denom) < margin) | ((t > PacketFloat(-BVH_PACKET_MARGIN)) & (t < t_max));
+    if (!intersect_backfacing) {
+      plane = plane & (denom < margin);
+    }
+    int bits = plane.Bits();
+    if (bits == 0) return 0;
+    PacketFloat inside = PacketTriangle(q.v0,q.e1,q.e2,o,d) |
+                         PacketTriangle(q.v0,q.e2,q.e3,o,d);
+    return bits & inside.Bits();
+  }
+
+  if (item.shape == BVH_PACKET_SPHERE) {
+    // as in Sphere::intersect (with b halved)
+    PacketFloat oc[3];
+    for (int a = 0; a < 3; a++) { oc[a] = o[a] - PacketFloat(item.center[a]); }
+    PacketFloat b = d[0]*oc[0] + d[1]*oc[1] + d[2]*oc[2];
+    PacketFloat c = oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2] - PacketFloat(item.radius2);
+    PacketFloat disc = b*b - c;
+    PacketFloat ok = disc >= PacketFloat(0) - margin * (b*b + Abs(c) + margin);
+    PacketFloat root = Sqrt(Max(disc,PacketFloat(0)));
+    PacketFloat t_near = PacketFloat(0) - b - root;
+    PacketFloat t_far = root - b;
+    ok = ok & (t_far > PacketFloat(0.01f) - margin) &
+      ((t_near < t_max) | (t_far < t_max));
+    return ok.Bits();
+  }
+
+  // no quick test for this object
+  return RAY_PACKET_ALL_LANES;
+}
+
+void BVH::IntersectPacket(const RayPacket &packet, Hit hits[], int portals[], bool answers[],
+                          bool use_rasterized_patches, bool intersect_backfacing,
+                          bool find_portals) const {
+  const BVHItem *closest[RAY_PACKET_SIZE];
+  Hit portal_hits[RAY_PACKET_SIZE];
+  // the distance each ray still has to look at (-1 for unused lanes)
+  alignas(32) float tmax[RAY_PACKET_SIZE];
+  for (int l = 0; l < RAY_PACKET_SIZE; l++) {
+    closest[l] = NULL;
+    tmax[l] = -1;
+  }
+  for (int l = 0; l < packet.count; l++) {
+    portals[l] = -1;
+    answers[l] = false;
+    tmax[l] = hits[l].getT();
+  }
+  if (nodes.empty()) return;
+
+  PacketFloat o[3], inv_dir[3];
+  for (int a = 0; a < 3; a++) {
+    o[a] = PacketFloat::Load(packet.orig[a]);
+    inv_dir[a] = PacketFloat::Load(packet.inv_dir[a]);
+  }
+  int active = packet.activeLanes();
+  // the rays of the lanes in the form the quad tests take
+  SnapshotRay srays[RAY_PACKET_SIZE];
+  for (int l = 0; l < packet.count; l++) { srays[l] = SnapshotRay(*packet.rays[l]); }
+
+  int todo[BVH_MAX_DEPTH+2];
+  int num_todo = 0;
+  todo[num_todo++] = 0;
+  while (num_todo > 0) {
+    int index = todo[--num_todo];
+    const BVHNode &node = nodes[index];
+
+    // slab test of all the rays at once
+    const BVHPacketBox &box = packet_boxes[index];
+    PacketFloat t0(0);
+    PacketFloat t1 = PacketFloat::Load(tmax);
+    t1 = t1 + PacketFloat(BVH_PACKET_MARGIN) * (t1 + PacketFloat(1));
+    for (int a = 0; a < 3; a++) {
+      PacketFloat tnear = (PacketFloat(box.min[a]) - o[a]) * inv_dir[a];
+      PacketFloat tfar  = (PacketFloat(box.max[a]) - o[a]) * inv_dir[a];
+      t0 = Max(t0,Min(tnear,tfar));
+      t1 = Min(t1,Max(tnear,tfar));
+    }
+    int mask = (t0 <= t1).Bits() & active;
+    if (mask == 0) continue;
+
+    if (node.count > 0) {
+      for (int i = node.offset; i < node.offset+node.count; i++) {
+        const BVHItem &item = items[i];
+        if (item.type == BVH_PORTAL_SIDE) {
+          if (!find_portals) continue;
+          for (int l = 0; l < packet.count; l++) {
+            if (!(mask & (1 << l))) continue;
+            Hit temp;
+            if (mesh->getPortalSide(item.index).intersectRay(*packet.rays[l],temp) &&
+                (temp.getT() < portal_hits[l].getT() ||
+                 (temp.getT() == portal_hits[l].getT() && item.index < portals[l]))) {
+              portal_hits[l] = temp;
+              portals[l] = item.index;
+              tmax[l] = mymin(hits[l].getT(),portal_hits[l].getT());
+            }
+          }
+          continue;
+        }
+        if (item.type == BVH_RASTERIZED_FACE && !use_rasterized_patches) continue;
+        if (item.type == BVH_PRIMITIVE && use_rasterized_patches) continue;
+        int candidates = mask & PacketFilter(packet_items[i],packet,tmax,intersect_backfacing);
+        for (int l = 0; l < packet.count; l++) {
+          if (!(candidates & (1 << l))) continue;
+          if (IntersectItem(item,*packet.rays[l],srays[l],hits[l],closest[l],
+                            use_rasterized_patches,intersect_backfacing)) {
+            answers[l] = true;
+            tmax[l] = mymin(hits[l].getT(),portal_hits[l].getT());
+          }
+        }
+      }
+    } else {
+      // visit the nearer child first (the same for all the rays)
+      assert (num_todo+2 <= BVH_MAX_DEPTH+2);
+      if (packet.dir[node.axis][0] >= 0) {
+        todo[num_todo++] = node.offset;
+        todo[num_todo++] = index+1;
+      } else {
+        todo[num_todo++] = index+1;
+        todo[num_todo++] = node.offset;
+      }
+    }
+  }
+
+  // as in Intersect, a portal only wins if it is strictly closer
+  for (int l = 0; l < packet.count; l++) {
+    if (portals[l] >= 0 && portal_hits[l].getT() < hits[l].getT()) {
+      hits[l] = portal_hits[l];
+      answers[l] = true;
+    } else {
+      portals[l] = -1;
+    }
+  }
+}
+
+// ==================================================================
@@ -0,0 +1,128 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <vector>
+#include "boundingbox.h"
+#include "packet.h"
+
+class Mesh;
+class Ray;
+class Hit;
+class SceneSnapshot;
+struct SnapshotRay;
+
+// ==================================================================
+// The different kinds of scene objects stored in the hierarchy.  The
+// index refers back into the matching list of the Mesh.
+
+enum BVH_ITEM_TYPE { BVH_ORIGINAL_QUAD, BVH_RASTERIZED_FACE, BVH_PRIMITIVE, BVH_PORTAL_SIDE };
+
+struct BVHItem {
+  BVH_ITEM_TYPE type;
+  int index;
+};
+
+// A node of the flattened hierarchy.  The first child of an interior
+// node is always stored directly after its parent.
+struct BVHNode {
+  BoundingBox bbox;
+  int offset;  // leaf: index of the first item, interior: index of the second child
+  int count;   // leaf: number of items, interior: 0
+  int axis;    // interior: the axis the children were split along
+};
+
+// Single precision copies of the node boxes and of the spheres for the
+// SIMD packet tests (the quads are read from the scene snapshot).
+// These are only used to quickly reject rays (with some margin), the
+// hits are always computed by the exact tests of the objects.
+struct BVHPacketBox {
+  float min[3];
+  float max[3];
+};
+
+enum BVH_PACKET_SHAPE { BVH_PACKET_NONE, BVH_PACKET_QUAD, BVH_PACKET_SPHERE };
+
+struct BVHPacketItem {
+  BVH_PACKET_SHAPE shape;
+  int quad;          // quad: the index in the scene snapshot
+  float center[3];   // sphere
+  float radius2;     // sphere
+};
+
+// ==================================================================
+// A bounding volume hierarchy over all of the ray traceable objects
+// of the mesh (original quads, rasterized primitive faces, implicit
+// primitives and portal sides).  The quads are taken from (and
+// intersected through) the scene snapshot of the mesh, which must be
+// built first.  The hierarchy is built once, top down, using
+// the surface area heuristic evaluated at a fixed number of bins.
+
+class BVH {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  BVH() { mesh = NULL; snapshot = NULL; sah_cost = 0; build_time = 0; num_leaves = 0; }
+
+  void Build(const Mesh *m);
+
+  // =========
+  // ACCESSORS
+  int numNodes() const { return nodes.size(); }
+  int numLeaves() const { return num_leaves; }
+  int numItems() const { return items.size(); }
+  double getSAHCost() const { return sah_cost; }
+  double getBuildTime() const { return build_time; }
+  void PrintReport() const;
+
+  // ==========
+  // RAYTRACING
+  // finds the closest hit, same semantics as the brute force loop
+  // in RayTracer::CastRay
+  bool Intersect(const Ray &ray, Hit &h, bool use_rasterized_patches,
+                 bool intersect_backfacing, int *portal_out) const;
+  // returns as soon as any object is found closer than tmax
+  bool Occluded(const Ray &ray, float tmax, bool use_rasterized_patches,
+                bool intersect_backfacing, bool include_portals) const;
+  // Intersect for a packet of rays that point into the same octant.
+  // The nodes are tested for all rays at once, the results (one per
+  // ray of the packet) are identical to calling Intersect per ray.
+  void IntersectPacket(const RayPacket &packet, Hit hits[], int portals[], bool answers[],
+                       bool use_rasterized_patches, bool intersect_backfacing,
+                       bool find_portals) const;
+
+ private:
+
+  // HELPER FUNCTIONS
+  struct BuildRecord {
+    BVHItem item;
+    BoundingBox bbox;
+    Vec3f centroid;
+  };
+  BoundingBox ItemBoundingBox(const BVHItem &item) const;
+  int QuadIndex(const BVHItem &item) const;
+  int BuildRecursive(std::vector<BuildRecord> &records, int start, int end, int depth);
+  double ComputeSAHCost() const;
+  void BuildPacketData();
+  int PacketFilter(const BVHPacketItem &item, const RayPacket &packet, const float tmax[],
+                   bool intersect_backfacing) const;
+  bool IntersectItem(const BVHItem &item, const Ray &ray, const SnapshotRay &sray, Hit &h,
+                     const BVHItem *&closest, bool use_rasterized_patches,
+                     bool intersect_backfacing) const;
+
+  // REPRESENTATION
+  const Mesh *mesh;
+  const SceneSnapshot *snapshot;
+  std::vector<BVHNode> nodes;
+  std::vector<BVHItem> items;
+  std::vector<BVHPacketBox> packet_boxes;   // one per node
+  std::vector<BVHPacketItem> packet_items;  // one per item
+  int num_leaves;
+  double sah_cost;
+  double build_time;  // in seconds
+};
+
+// ==================================================================
+
+#endif
@@ -8,6 +8,7 @@
 #include "mesh.h"
 #include "ray.h"
 #include "hit.h"
+#include "boundingbox.h"
 
 // ====================================================================
 // ====================================================================
@@ -114,6 +115,21 @@ bool CylinderRing::intersect(const Ray &r, Hit &h) const {
   return answer;
 } 
 
+bool CylinderRing::occludes(const Ray &r, float tmax) const {
+  float t;
+  Vec3f normal;
+  if (IntersectFiniteCylinder(r,center,outer_radius,height,t,normal) && t < tmax) return true;
+  if (IntersectFiniteCylinder(r,center,inner_radius,height,t,normal) && t < tmax) return true;
+  if (IntersectAnnulus(r,center+Vec3f(0,height/2.0,0),inner_radius,outer_radius,t,normal) && t < tmax) return true;
+  if (IntersectAnnulus(r,center-Vec3f(0,height/2.0,0),inner_radius,outer_radius,t,normal) && t < tmax) return true;
+  return false;
+}
+
+BoundingBox CylinderRing::getBoundingBox() const {
+  Vec3f extent(outer_radius,height/2.0,outer_radius);
+  return BoundingBox(center-extent,center+extent);
+}
+
 // ====================================================================
 // ====================================================================
 
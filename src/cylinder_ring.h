@@ -22,6 +22,8 @@ public:
 
   // for ray tracing
   bool intersect(const Ray &r, Hit &h) const;
+  bool occludes(const Ray &r, float tmax) const;
+  BoundingBox getBoundingBox() const;
 
   // for OpenGL rendering & radiosity
   void addRasterizedFaces(Mesh *m, ArgParser *args);
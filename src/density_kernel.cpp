@@ -0,0 +1,140 @@
+#include <cmath>
+
+#include "density_kernel.h"
+#include "kdtree.h"
+#include "photon.h"
+
+// ==================================================================
+// CONSTRUCTOR
+
+DensityKernel::DensityKernel(const Vec3f &_point, const Vec3f *_normal, double _radius_sq,
+                             enum PHOTON_FILTER _filter) {
+  for (int a = 0; a < 3; a++) {
+    point[a] = _point[a];
+    normal[a] = (_normal != NULL) ? (*_normal)[a] : 0;
+  }
+  use_normal = (_normal != NULL);
+  radius_sq = _radius_sq;
+  filter = _filter;
+  count = 0;
+  // (the lanes that don't count keep the values of earlier blocks,
+  // but must hold numbers)
+  for (int a = 0; a < 3; a++) {
+    for (int j = 0; j < DENSITY_KERNEL_BLOCK; j++) { energy[a][j] = 0; }
+  }
+  for (int a = 0; a < 3; a++) { sum[a] = PacketFloat(0.0f); }
+  accepted = PacketFloat(0.0f);
+}
+
+double DensityKernel::Area() const {
+  double area = M_PI * radius_sq;
+  if (filter == PHOTON_FILTER_CONE) return area / 3;
+  if (filter == PHOTON_FILTER_EPANECHNIKOV) return area / 2;
+  return area;
+}
+
+// ==================================================================
+// THE CULL
+
+int CullPhotonBlock(const PacketFloat p[3], const float point[3], const float *normal, float radius_sq,
+                    const KDTree *const lane_trees[], const int lane_indices[],
+                    PacketFloat &dist_sq, PacketFloat &mask) {
+  PacketFloat d[3];
+  for (int a = 0; a < 3; a++) {
+    d[a] = p[a] - PacketFloat(point[a]);
+  }
+  dist_sq = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+  mask = dist_sq <= PacketFloat(radius_sq);
+  int bits = mask.Bits();
+  if (bits == 0 || normal == NULL) return bits;
+
+  // unpack the directions of the photons within the radius (the other
+  // lanes must hold numbers)
+  alignas(32) float direction[3][DENSITY_KERNEL_BLOCK] = {};
+  for (int j = 0; j < DENSITY_KERNEL_BLOCK; j++) {
+    if (!(bits & (1 << j))) continue;
+    Vec3f dir = UnpackDirection(lane_trees[j]->getPackedDirectionFrom(lane_indices[j]));
+    for (int a = 0; a < 3; a++) { direction[a][j] = dir[a]; }
+  }
+  PacketFloat dot = (PacketFloat::Load(direction[0]) * PacketFloat(normal[0]) +
+                     PacketFloat::Load(direction[1]) * PacketFloat(normal[1]) +
+                     PacketFloat::Load(direction[2]) * PacketFloat(normal[2]));
+  mask = mask & (dot < PacketFloat(0.0f));
+  return mask.Bits();
+}
+
+// ==================================================================
+// THE BLOCKS
+
+void DensityKernel::AddRun(const KDTree *tree, int first, int length) {
+  // the whole blocks straight from the arrays of the tree
+  for ( ; length >= DENSITY_KERNEL_BLOCK; first += DENSITY_KERNEL_BLOCK, length -= DENSITY_KERNEL_BLOCK) {
+    for (int j = 0; j < DENSITY_KERNEL_BLOCK; j++) {
+      run_trees[j] = tree;
+      run_indices[j] = first + j;
+    }
+    PacketFloat p[3];
+    for (int a = 0; a < 3; a++) { p[a] = PacketFloat::LoadUnaligned(tree->getCoordinates(a) + first); }
+    TestBlock(p,run_trees,run_indices);
+  }
+  for (int j = 0; j < length; j++) { Add(tree,first + j); }
+}
+
+void DensityKernel::TestBlock() {
+  // the unused lanes are far away
+  for (int j = count; j < DENSITY_KERNEL_BLOCK; j++) {
+    for (int a = 0; a < 3; a++) { position[a][j] = 1e30f; }
+  }
+  count = 0;
+  PacketFloat p[3];
+  for (int a = 0; a < 3; a++) { p[a] = PacketFloat::Load(position[a]); }
+  TestBlock(p,trees,indices);
+}
+
+void DensityKernel::TestBlock(const PacketFloat p[3], const KDTree *const lane_trees[], const int lane_indices[]) {
+  float r_sq = radius_sq;
+  PacketFloat dist_sq, mask;
+  int bits = CullPhotonBlock(p,point,use_normal ? normal : NULL,r_sq * (1 + DENSITY_KERNEL_TOLERANCE),
+                             lane_trees,lane_indices,dist_sq,mask);
+  if (bits == 0) return;
+
+  // unpack the energies of the photons that count
+  for (int j = 0; j < DENSITY_KERNEL_BLOCK; j++) {
+    if (!(bits & (1 << j))) continue;
+    // (as UnpackRGBE, the mantissas are exact in single precision)
+    unsigned int rgbe = lane_trees[j]->getPackedEnergy(lane_indices[j]);
+    int e = rgbe >> 24;
+    float f = (e == 0) ? 0.0f : ldexpf(1.0f, e - (128+8));
+    energy[0][j] = f * (rgbe & 255);
+    energy[1][j] = f * ((rgbe >> 8) & 255);
+    energy[2][j] = f * ((rgbe >> 16) & 255);
+  }
+
+  PacketFloat weight(1.0f);
+  if (filter == PHOTON_FILTER_CONE) {
+    weight = Max(PacketFloat(0.0f), PacketFloat(1.0f) - Sqrt(dist_sq / PacketFloat(r_sq)));
+  } else if (filter == PHOTON_FILTER_EPANECHNIKOV) {
+    weight = Max(PacketFloat(0.0f), PacketFloat(1.0f) - dist_sq / PacketFloat(r_sq));
+  }
+  weight = Masked(mask,weight);
+  for (int a = 0; a < 3; a++) {
+    sum[a] = sum[a] + weight * PacketFloat::Load(energy[a]);
+  }
+  accepted = accepted + Masked(mask,PacketFloat(1.0f));
+}
+
+int DensityKernel::Finish(Vec3f &answer) {
+  if (count > 0) TestBlock();
+  // add up the lanes, left to right
+  alignas(32) float lanes[4][DENSITY_KERNEL_BLOCK];
+  for (int a = 0; a < 3; a++) { sum[a].Store(lanes[a]); }
+  accepted.Store(lanes[3]);
+  double total[4] = { 0, 0, 0, 0 };
+  for (int a = 0; a < 4; a++) {
+    for (int j = 0; j < DENSITY_KERNEL_BLOCK; j++) { total[a] += lanes[a][j]; }
+  }
+  answer = Vec3f(total[0],total[1],total[2]);
+  return int(total[3]);
+}
+
+// ==================================================================
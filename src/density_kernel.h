@@ -0,0 +1,112 @@
+#ifndef _DENSITY_KERNEL_H_
+#define _DENSITY_KERNEL_H_
+
+#include "vectors.h"
+#include "meshdata.h"
+#include "packet.h"
+#include "kdtree.h"
+
+// the photons are tested a block at a time, one per SIMD lane
+#define DENSITY_KERNEL_BLOCK RAY_PACKET_SIZE
+
+// (the distance test is single precision: this much slack in the
+// squared radius keeps the photons a double precision query found at
+// the very edge of its radius)
+#define DENSITY_KERNEL_TOLERANCE 1e-4f
+
+// ==================================================================
+// The test of a block of photons, one per lane at the positions p
+// (photon lane_indices[j] of lane_trees[j]): returns the lanes of the
+// photons within sqrt(radius_sq) of the point that (if normal isn't
+// NULL) arrived at the front of the surface, as bits & as a mask, and
+// the squared distances of all of the lanes.  Only the directions of
+// the photons within the radius are unpacked.  Both the density
+// estimates & the nearest neighbor queries (KDTree::CullBucket) cull
+// their candidates with it.
+
+int CullPhotonBlock(const PacketFloat p[3], const float point[3], const float *normal, float radius_sq,
+                    const KDTree *const lane_trees[], const int lane_indices[],
+                    PacketFloat &dist_sq, PacketFloat &mask);
+
+// ==================================================================
+// The inner loop of a photon density estimate.  The positions of the
+// candidate photons of a query are copied into a block in "structure
+// of arrays" form (or, for the runs of a kdtree walk, read straight
+// from the tree's arrays), and every full block is tested & summed
+// with PacketFloat (8 lanes with AVX, 4 with SSE, else plain loops).  Only
+// the photons that pass CullPhotonBlock have their energies unpacked;
+// each counts weighted by the filter,
+//
+//   BOX:          1
+//   CONE:         1 - d/r                 (Jensen's cone filter, k = 1)
+//   EPANECHNIKOV: 1 - d^2/r^2
+//
+// Dividing the weighted energy by Area() gives the irradiance: the
+// area of the disk times the mean weight of a uniform spread of
+// photons over it (1, 1/3 & 1/2).
+
+class DensityKernel {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR
+  // the photons within sqrt(radius_sq) of the point (that arrived at
+  // the front of the surface, if normal isn't NULL)
+  DensityKernel(const Vec3f &point, const Vec3f *normal, double radius_sq, enum PHOTON_FILTER filter);
+
+  // =========
+  // MODIFIERS
+  // a candidate photon of the tree (the block is tested when it's full)
+  void Add(const KDTree *tree, int i);
+  // the candidate photons [first,first+length) of the tree (whole
+  // blocks are tested where they are, without a copy)
+  void AddRun(const KDTree *tree, int first, int length);
+  // test the photons still in the block, and return the number of
+  // photons that counted & their weighted energy
+  int Finish(Vec3f &energy);
+
+  // =========
+  // ACCESSORS
+  // the area the weighted energy is spread over
+  double Area() const;
+
+ private:
+
+  void TestBlock();
+  void TestBlock(const PacketFloat p[3], const KDTree *const lane_trees[], const int lane_indices[]);
+
+  // REPRESENTATION
+  // the query
+  float point[3];
+  float normal[3];
+  bool use_normal;
+  double radius_sq;
+  enum PHOTON_FILTER filter;
+  // the block
+  int count;
+  const KDTree *trees[DENSITY_KERNEL_BLOCK];
+  int indices[DENSITY_KERNEL_BLOCK];
+  const KDTree *run_trees[DENSITY_KERNEL_BLOCK];
+  int run_indices[DENSITY_KERNEL_BLOCK];
+  alignas(32) float position[3][DENSITY_KERNEL_BLOCK];
+  alignas(32) float energy[3][DENSITY_KERNEL_BLOCK];
+  // the sums so far, per lane
+  PacketFloat sum[3];
+  PacketFloat accepted;
+};
+
+// ==================================================================
+
+inline void DensityKernel::Add(const KDTree *tree, int i) {
+  trees[count] = tree;
+  indices[count] = i;
+  for (int a = 0; a < 3; a++) {
+    position[a][count] = tree->getCoordinates(a)[i];
+  }
+  if (++count == DENSITY_KERNEL_BLOCK) TestBlock();
+}
+
+// ==================================================================
+
+#endif
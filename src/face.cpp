@@ -142,6 +142,48 @@ bool Face::plane_intersect(const Ray &r, Hit &h, bool intersect_backfacing) cons
   return 0;
 }
 
+bool Face::occludes(const Ray &r, float tmax, bool intersect_backfacing) const {
+  Vertex *a = (*this)[0];
+  Vertex *b = (*this)[1];
+  Vertex *c = (*this)[2];
+  Vertex *d = (*this)[3];
+  return triangle_occludes(r,tmax,a,b,c,intersect_backfacing) || triangle_occludes(r,tmax,a,c,d,intersect_backfacing);
+}
+
+bool Face::triangle_occludes(const Ray &r, float tmax, Vertex *a, Vertex *b, Vertex *c, bool intersect_backfacing) const {
+
+  // same system as triangle_intersect, but also solve for t directly
+  // rather than intersecting with the plane of the face
+  Vec3f Ro = r.getOrigin();
+  Vec3f Rd = r.getDirection();
+  Vec3f ab = a->get() - b->get();
+  Vec3f ac = a->get() - c->get();
+  Vec3f ao = a->get() - Ro;
+
+  double detA = Matrix::det3x3(ab.x(),ac.x(),Rd.x(),
+                               ab.y(),ac.y(),Rd.y(),
+                               ab.z(),ac.z(),Rd.z());
+
+  if (fabs(detA) <= 0.000001) return 0;
+
+  // detA = Rd . ((b-a)x(c-b)), so it's positive when we see the back side
+  if (!intersect_backfacing && detA >= 0) return 0;
+
+  double t = Matrix::det3x3(ab.x(),ac.x(),ao.x(),
+                            ab.y(),ac.y(),ao.y(),
+                            ab.z(),ac.z(),ao.z()) / detA;
+  if (t <= EPSILON || t >= tmax) return 0;
+
+  double beta = Matrix::det3x3(ao.x(),ac.x(),Rd.x(),
+                               ao.y(),ac.y(),Rd.y(),
+                               ao.z(),ac.z(),Rd.z()) / detA;
+  if (beta < -0.00001 || beta > 1.00001) return 0;
+  double gamma = Matrix::det3x3(ab.x(),ao.x(),Rd.x(),
+                                ab.y(),ao.y(),Rd.y(),
+                                ab.z(),ao.z(),Rd.z()) / detA;
+  return (gamma >= -0.00001 && gamma <= 1.00001 && beta + gamma <= 1.00001);
+}
+
 Vec3f Face::computeNormal() const {
   // note: this face might be non-planar, so average the two triangle normals
   Vec3f a = (*this)[0]->get();
@@ -59,6 +59,8 @@ public:
   // ==========
   // RAYTRACING
   bool intersect(const Ray &r, Hit &h, bool intersect_backfacing) const;
+  // any hit closer than tmax? (no normal, material or texture lookup)
+  bool occludes(const Ray &r, float tmax, bool intersect_backfacing) const;
 
   // =========
   // RADIOSITY
@@ -70,6 +72,7 @@ protected:
   // helper functions
   bool triangle_intersect(const Ray &r, Hit &h, Vertex *a, Vertex *b, Vertex *c, bool intersect_backfacing) const;
   bool plane_intersect(const Ray &r, Hit &h, bool intersect_backfacing) const;
+  bool triangle_occludes(const Ray &r, float tmax, Vertex *a, Vertex *b, Vertex *c, bool intersect_backfacing) const;
 
   // don't use this constructor
   Face& operator= (const Face&) { assert(0); exit(0); }
@@ -0,0 +1,135 @@
+#include <cmath>
+
+#include "irradiance_cache.h"
+#include "utils.h"
+
+// ==================================================================
+// CONSTRUCTION
+
+IrradianceCache::IrradianceCache(const BoundingBox &bbox, double _accuracy) {
+  accuracy = _accuracy;
+  assert (accuracy > 0);
+  min = bbox.getMin();
+  cell_size = mymax(bbox.maxDim(),1e-6) / double(IRRADIANCE_CACHE_GRID);
+  Vec3f size = bbox.getMax() - bbox.getMin();
+  for (int a = 0; a < 3; a++) {
+    divs[a] = mymax(1,mymin(IRRADIANCE_CACHE_GRID,(int)ceil(size[a] / cell_size)));
+  }
+  cells.resize(divs[0]*divs[1]*divs[2]);
+}
+
+void IrradianceCache::CellCoordinates(const Vec3f &p, int c[3]) const {
+  for (int a = 0; a < 3; a++) {
+    c[a] = mymax(0,mymin(divs[a]-1,(int)floor((p[a] - min[a]) / cell_size)));
+  }
+}
+
+// the record is listed in every cell within accuracy * radius of it
+void IrradianceCache::AddRecord(const IrradianceRecord &record) {
+  int index = records.size();
+  records.push_back(record);
+  double reach = accuracy * record.radius;
+  int lo[3], hi[3];
+  CellCoordinates(record.position - Vec3f(reach,reach,reach),lo);
+  CellCoordinates(record.position + Vec3f(reach,reach,reach),hi);
+  for (int k = lo[2]; k <= hi[2]; k++) {
+    for (int j = lo[1]; j <= hi[1]; j++) {
+      for (int i = lo[0]; i <= hi[0]; i++) {
+        cells[CellIndex(i,j,k)].push_back(index);
+      }
+    }
+  }
+}
+
+// A least squares fit of a plane (in the tangent plane of the record)
+// to the irradiance of the records within twice the spacing the
+// accuracy asks for.  Records with fewer than 3 neighbors (or only
+// neighbors along a line) keep a zero gradient.
+void IrradianceCache::EstimateGradients() {
+  std::vector<int> visited(records.size(),-1);
+  std::vector<Vec3f> gradients(3*records.size());
+  for (unsigned int i = 0; i < records.size(); i++) {
+    const IrradianceRecord &r = records[i];
+    Vec3f tangent = fabs(r.normal.x()) < 0.9 ? Vec3f(1,0,0) : Vec3f(0,1,0);
+    tangent -= tangent.Dot3(r.normal) * r.normal;
+    tangent.Normalize();
+    Vec3f bitangent;
+    Vec3f::Cross3(bitangent,r.normal,tangent);
+
+    double reach = 2 * accuracy * r.radius;
+    int lo[3], hi[3];
+    CellCoordinates(r.position - Vec3f(reach,reach,reach),lo);
+    CellCoordinates(r.position + Vec3f(reach,reach,reach),hi);
+    double tt = 0, tb = 0, bb = 0;
+    Vec3f et(0,0,0), eb(0,0,0);
+    int count = 0;
+    for (int k = lo[2]; k <= hi[2]; k++) {
+      for (int j = lo[1]; j <= hi[1]; j++) {
+        for (int l = lo[0]; l <= hi[0]; l++) {
+          const std::vector<int> &cell = cells[CellIndex(l,j,k)];
+          for (unsigned int m = 0; m < cell.size(); m++) {
+            int other = cell[m];
+            if (other == (int)i || visited[other] == (int)i) continue;
+            visited[other] = i;
+            const IrradianceRecord &o = records[other];
+            Vec3f offset = o.position - r.position;
+            if (offset.Length() > reach || o.normal.Dot3(r.normal) < 0.9) continue;
+            double dt = offset.Dot3(tangent);
+            double db = offset.Dot3(bitangent);
+            Vec3f de = o.irradiance - r.irradiance;
+            tt += dt*dt; tb += dt*db; bb += db*db;
+            et += dt * de;
+            eb += db * de;
+            count++;
+          }
+        }
+      }
+    }
+    for (int c = 0; c < 3; c++) { gradients[3*i+c] = Vec3f(0,0,0); }
+    double det = tt*bb - tb*tb;
+    if (count < 3 || det <= 1e-12 * (tt+bb) * (tt+bb)) continue;
+    for (int c = 0; c < 3; c++) {
+      double gt = (bb * et[c] - tb * eb[c]) / det;
+      double gb = (tt * eb[c] - tb * et[c]) / det;
+      gradients[3*i+c] = gt * tangent + gb * bitangent;
+    }
+  }
+  for (unsigned int i = 0; i < records.size(); i++) {
+    for (int c = 0; c < 3; c++) { records[i].gradient[c] = gradients[3*i+c]; }
+  }
+}
+
+// ==================================================================
+// INTERPOLATION
+
+bool IrradianceCache::Interpolate(const Vec3f &point, const Vec3f &normal, Vec3f &irradiance) const {
+  int c[3];
+  CellCoordinates(point,c);
+  const std::vector<int> &cell = cells[CellIndex(c[0],c[1],c[2])];
+
+  Vec3f sum(0,0,0);
+  double total_weight = 0;
+  for (unsigned int i = 0; i < cell.size(); i++) {
+    const IrradianceRecord &r = records[cell[i]];
+    double cosine = normal.Dot3(r.normal);
+    if (cosine <= 0) continue;
+    Vec3f offset = point - r.position;
+    double error = offset.Length() / r.radius + sqrt(mymax(0.0,1 - cosine));
+    if (error >= accuracy) continue;
+    // a record behind the point doesn't see what the point sees
+    if (offset.Dot3(normal + r.normal) < -0.1 * r.radius) continue;
+    double weight = 1 / mymax(error,1e-6);
+    Vec3f estimate = r.irradiance + Vec3f(r.gradient[0].Dot3(offset),
+                                          r.gradient[1].Dot3(offset),
+                                          r.gradient[2].Dot3(offset));
+    sum += weight * estimate;
+    total_weight += weight;
+  }
+  if (total_weight <= 0) return false;
+  irradiance = (1 / total_weight) * sum;
+  // (the extrapolation must not go negative)
+  irradiance = Vec3f(mymax(0.0,irradiance.r()),mymax(0.0,irradiance.g()),mymax(0.0,irradiance.b()));
+  return true;
+}
+
+// ==================================================================
@@ -0,0 +1,86 @@
+#ifndef _IRRADIANCE_CACHE_H_
+#define _IRRADIANCE_CACHE_H_
+
+#include <vector>
+#include "vectors.h"
+#include "boundingbox.h"
+
+// the cache is a uniform grid with this many cells along the longest
+// side of the scene
+#define IRRADIANCE_CACHE_GRID 32
+
+// ==================================================================
+// A gathered estimate of the indirect light, and the region around it
+// where it may be interpolated.
+
+struct IrradianceRecord {
+  Vec3f position;
+  Vec3f normal;
+  Vec3f irradiance;
+  // the change of the red, green & blue irradiance per unit distance
+  // (in the plane of the surface)
+  Vec3f gradient[3];
+  double radius;
+};
+
+// A point where the cache may need a record (the photon hits).
+struct IrradianceCacheSite {
+  Vec3f position;
+  Vec3f normal;
+};
+
+// ==================================================================
+// Ward's irradiance cache: the indirect light changes slowly over
+// diffuse surfaces, so rather than gathering photons at every hit it
+// is interpolated from the records nearby.  Record i is valid at
+// point x with normal n if its error
+//
+//    e_i = |x - x_i| / R_i + sqrt(1 - n . n_i)
+//
+// is below the accuracy a, and x isn't in front of it.  The estimate
+// is the average of the (gradient extrapolated) records, weighted by
+// 1 / e_i.  The gradients are fit to the neighboring records (a single
+// photon density estimate is far too noisy to differentiate).  Once
+// filled the cache is only read, from any thread.
+
+class IrradianceCache {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  IrradianceCache(const BoundingBox &bbox, double accuracy);
+
+  // =========
+  // ACCESSORS
+  int numRecords() const { return records.size(); }
+  const IrradianceRecord& getRecord(int i) const { return records[i]; }
+  double getAccuracy() const { return accuracy; }
+  // false if no record is valid at the point
+  bool Interpolate(const Vec3f &point, const Vec3f &normal, Vec3f &irradiance) const;
+
+  // =========
+  // MODIFIERS
+  void AddRecord(const IrradianceRecord &record);
+  // fit the gradient of each record to the records around it
+  void EstimateGradients();
+
+ private:
+
+  // HELPER FUNCTIONS
+  int CellIndex(int i, int j, int k) const { return (k*divs[1] + j)*divs[0] + i; }
+  void CellCoordinates(const Vec3f &p, int c[3]) const;
+
+  // REPRESENTATION
+  double accuracy;
+  std::vector<IrradianceRecord> records;
+  // the records that may be valid somewhere within each cell
+  std::vector<std::vector<int> > cells;
+  Vec3f min;
+  double cell_size;
+  int divs[3];
+};
+
+// ==================================================================
+
+#endif
@@ -1,194 +1,287 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <thread>
+
 #include "kdtree.h"
+#include "density_kernel.h"
 #include "utils.h"
 
-#define MAX_PHOTONS_BEFORE_SPLIT 100
-#define MAX_DEPTH 15
+// subtrees with fewer photons are never split across threads
+#define MIN_PHOTONS_PER_THREAD 10000
+// the cells drawn for visualization hold at most this many photons
+#define MAX_PHOTONS_PER_CELL 100
 
 // ==================================================================
-// DESTRUCTOR
-// ==================================================================
-KDTree::~KDTree() {
-  if (!isLeaf()) {
-    delete child1;
-    delete child2;
-  } else {
-    // delete all the photons (this is done automatically since they
-    // are stored directly in an STL vector, not using pointers)
-  }
+// HELPER FUNCTIONS
+
+// the size of the left subtree of a left-balanced tree of n nodes
+static int LeftSubtreeSize(int n) {
+  if (n <= 1) return 0;
+  // the levels above the last are full
+  int full = 1;
+  while (2*full+1 <= n) full = 2*full+1;
+  int last_level = n - full;
+  int half = (full+1) / 2;
+  return (half - 1) + std::min(last_level, half);
 }
 
+static inline size_t RoundUpToAlignment(size_t bytes) {
+  return (bytes + KDTREE_ALIGNMENT - 1) & ~size_t(KDTREE_ALIGNMENT - 1);
+}
+
+int KDTree::SubtreeSize(int node) const {
+  int n = numPhotons();
+  int size = 0;
+  for (int first = node, last = node; first < n; first = 2*first+1, last = 2*last+2) {
+    size += std::min(last, n-1) - first + 1;
+  }
+  return size;
+}
 
 // ==================================================================
-// HELPER FUNCTIONS
+// CONSTRUCTION
 
-bool KDTree::PhotonInCell(const Photon &p) {
-  const Vec3f& min = bbox.getMin();
-  const Vec3f& max = bbox.getMax();
-  const Vec3f &position = p.getPosition();
-  if (position.x() > min.x() - EPSILON &&
-      position.y() > min.y() - EPSILON &&
-      position.z() > min.z() - EPSILON &&
-      position.x() < max.x() + EPSILON &&
-      position.y() < max.y() + EPSILON &&
-      position.z() < max.z() + EPSILON)
-    return true;
-  return false;
+KDTree::KDTree(const BoundingBox &_bbox) {
+  bbox = _bbox;
+  storage = NULL;
+  data = NULL;
+  num_photons = 0;
+  built = false;
 }
 
-int KDTree::numPhotons() const {
-  int count = photons.size();
-  if (child1 != NULL) count+=child1->numPhotons();
-  if (child2 != NULL) count+=child2->numPhotons();
-  return count;
+KDTree::KDTree(const BoundingBox &_bbox, int _num_photons, const char *_data) {
+  bbox = _bbox;
+  storage = NULL;
+  num_photons = _num_photons;
+  // (the arrays are only written while building)
+  CarveArrays(const_cast<char*>(_data));
+  built = true;
 }
 
-int KDTree::numBoxes() const {
-  int count = isLeaf();
-  if (child1 != NULL) count+=child1->numBoxes();
-  if (child2 != NULL) count+=child2->numBoxes();
-  return count;
+KDTree::~KDTree() {
+  delete [] storage;
 }
 
-bool KDTree::overlaps(const BoundingBox &bb) const {
-  const Vec3f& bb_min = bb.getMin();
-  const Vec3f& bb_max = bb.getMax();
-  const Vec3f& tmp_min = bbox.getMin();
-  const Vec3f& tmp_max = bbox.getMax();
-  if (bb_min.x() > tmp_max.x()) return false;
-  if (tmp_min.x() > bb_max.x()) return false;
-  if (bb_min.y() > tmp_max.y()) return false;
-  if (tmp_min.y() > bb_max.y()) return false;
-  if (bb_min.z() > tmp_max.z()) return false;
-  if (tmp_min.z() > bb_max.z()) return false;
-  return true;
+// the coordinates, the axes, the directions, the energies & the
+// bounces, each array aligned
+size_t KDTree::DataSize(int n) {
+  return 3 * RoundUpToAlignment(n * sizeof(float)) +
+    RoundUpToAlignment(n * sizeof(unsigned char)) +
+    RoundUpToAlignment(n * sizeof(unsigned short)) +
+    RoundUpToAlignment(n * sizeof(unsigned int)) +
+    RoundUpToAlignment(n * sizeof(unsigned char));
 }
 
+void KDTree::CarveArrays(char *block) {
+  assert (uintptr_t(block) % KDTREE_ALIGNMENT == 0);
+  data = block;
+  int n = num_photons;
+  for (int a = 0; a < 3; a++) {
+    coordinates[a] = reinterpret_cast<float*>(block);
+    block += RoundUpToAlignment(n * sizeof(float));
+  }
+  axes = reinterpret_cast<unsigned char*>(block);
+  block += RoundUpToAlignment(n * sizeof(unsigned char));
+  directions = reinterpret_cast<unsigned short*>(block);
+  block += RoundUpToAlignment(n * sizeof(unsigned short));
+  energies = reinterpret_cast<unsigned int*>(block);
+  block += RoundUpToAlignment(n * sizeof(unsigned int));
+  bounces = reinterpret_cast<unsigned char*>(block);
+}
 
-// ==================================================================
 void KDTree::AddPhoton(const Photon &p) {
-  const Vec3f &position = p.getPosition();
-  assert (PhotonInCell(p));
-  if (isLeaf()) {
-    // this cell is a leaf node
-    photons.push_back(p);
-    if (photons.size() > MAX_PHOTONS_BEFORE_SPLIT && depth < MAX_DEPTH) {
-      SplitCell();
-    }
+  assert (!built);
+  photons.push_back(p);
+}
+
+void KDTree::AddPhotons(const std::vector<Photon> &p) {
+  assert (!built);
+  photons.insert(photons.end(),p.begin(),p.end());
+}
+
+void KDTree::Build(int num_threads) {
+  assert (!built);
+  int n = photons.size();
+  num_photons = n;
+  storage = new char[DataSize(n) + KDTREE_ALIGNMENT];
+  CarveArrays(reinterpret_cast<char*>(RoundUpToAlignment(uintptr_t(storage))));
+  BuildSubtree(photons,0,n,0,std::max(1,num_threads));
+  std::vector<Photon>().swap(photons);
+  built = true;
+}
+
+Photon KDTree::getPhoton(int i) const {
+  assert (built);
+  float position[3] = { coordinates[0][i], coordinates[1][i], coordinates[2][i] };
+  return Photon(position,directions[i],energies[i],bounces[i]);
+}
+
+// Place the median of input[start,end), along the axis the photons are
+// spread out most along, at node & build its subtrees from the photons
+// on either side.  (The subtrees share no photons & no nodes, so they
+// can be built at the same time.)
+void KDTree::BuildSubtree(std::vector<Photon> &input, int start, int end, int node, int num_threads) {
+  int n = end - start;
+  if (n <= 0) return;
+
+  BoundingBox extent(input[start].getPosition());
+  for (int i = start+1; i < end; i++) {
+    extent.Extend(input[i].getPosition());
+  }
+  Vec3f spread = extent.getMax() - extent.getMin();
+  int axis = 0;
+  if (spread.y() > spread[axis]) axis = 1;
+  if (spread.z() > spread[axis]) axis = 2;
+
+  int median = start + LeftSubtreeSize(n);
+  std::nth_element(input.begin()+start,input.begin()+median,input.begin()+end,
+                   [axis](const Photon &a, const Photon &b) {
+                     return a.getCoordinate(axis) < b.getCoordinate(axis); });
+  const Photon &p = input[median];
+  for (int a = 0; a < 3; a++) { coordinates[a][node] = p.getCoordinate(a); }
+  axes[node] = axis;
+  directions[node] = p.getPackedDirectionFrom();
+  energies[node] = p.getPackedEnergy();
+  bounces[node] = p.whichBounce();
+
+  if (num_threads > 1 && n > 2*MIN_PHOTONS_PER_THREAD) {
+    std::thread left([&]() { BuildSubtree(input,start,median,2*node+1,num_threads/2); });
+    BuildSubtree(input,median+1,end,2*node+2,num_threads-num_threads/2);
+    left.join();
   } else {
-    // this cell is not a leaf node
-    // decide which subnode to recurse into
-    if (split_axis == 0) {
-      if (position.x() < split_value)
-	child1->AddPhoton(p);
-      else
-	child2->AddPhoton(p);
-    } else if (split_axis == 1) {
-      if (position.y() < split_value)
-	child1->AddPhoton(p);
-      else
-	child2->AddPhoton(p);
-    } else {
-      assert (split_axis == 2);
-      if (position.z() < split_value)
-	child1->AddPhoton(p);
-      else
-	child2->AddPhoton(p);
-    }
+    BuildSubtree(input,start,median,2*node+1,1);
+    BuildSubtree(input,median+1,end,2*node+2,1);
   }
 }
 
-
 // ==================================================================
-void KDTree::CollectPhotonsInBox(const BoundingBox &bb, std::vector<Photon> &photons) const {
-  // explicitly store the queue of cells that must be checked (rather
-  // than write a recursive function)
-  std::vector<const KDTree*> todo;  
-  todo.push_back(this);
-  while (!todo.empty()) {
-    const KDTree *node = todo.back();
-    todo.pop_back(); 
-    if (!node->overlaps(bb)) continue;
-    if (node->isLeaf()) {
-      // if this cell overlaps & is a leaf, add all of the photons into the master list
-      // NOTE: these photons may not be inside of the query bounding box
-      const std::vector<Photon> &photons2 = node->getPhotons();
-      int num_photons = photons2.size();
-      for (int i = 0; i < num_photons; i++) {
-	photons.push_back(photons2[i]);
-      }
-    } else {
-      // if this cell is not a leaf, explore both children
-      todo.push_back(node->getChild1());
-      todo.push_back(node->getChild2());
-    } 
-  }
+// QUERIES
+
+void KDTree::CollectPhotonsInBox(const BoundingBox &bb, std::vector<Photon> &photons2) const {
+  VisitPhotonsInBox(bb,[&](int i) { photons2.push_back(getPhoton(i)); });
 }
 
 int KDTree::CountPhotonsInBox(const BoundingBox &bb) const {
   int total = 0;
-  std::vector<const KDTree*> todo;
-  todo.push_back(this);
-  while (!todo.empty()) {
-    const KDTree *node = todo.back();
-    todo.pop_back(); 
-    if (!node->overlaps(bb)) continue;
-    if (node->isLeaf()) {
-      // if this cell overlaps & is a leaf, add all of the photons into the master list
-      // NOTE: these photons may not be inside of the query bounding box
-      total += node->photons.size();
-    } else {
-      // if this cell is not a leaf, explore both children
-      todo.push_back(node->getChild1());
-      todo.push_back(node->getChild2());
-    } 
-  }
+  VisitPhotonsInBox(bb,[&](int) { total++; });
   return total;
 }
 
+int KDTree::SumPhotonsInRadius(const Vec3f &point, const Vec3f *normal, double dist_sq, Vec3f &energy) const {
+  DensityKernel kernel(point,normal,dist_sq,PHOTON_FILTER_BOX);
+  VisitRunsNearPoint(point,dist_sq,[&](int first, int length) { kernel.AddRun(this,first,length); });
+  return kernel.Finish(energy);
+}
 
-// ==================================================================
-void KDTree::SplitCell() {
-  const Vec3f& min = bbox.getMin();
-  const Vec3f& max = bbox.getMax();
-  float dx = max.x()-min.x();
-  float dy = max.y()-min.y();
-  float dz = max.z()-min.z();
-  // split this cell in the middle of the longest axis
-  Vec3f min1,min2,max1,max2;
-  if (dx >= dy && dx >= dz) {
-    split_axis = 0;
-    split_value = min.x()+dx/2.0;
-    min1 = Vec3f(min.x()    ,min.y(),min.z());
-    max1 = Vec3f(split_value,max.y(),max.z());
-    min2 = Vec3f(split_value,min.y(),min.z());
-    max2 = Vec3f(max.x()       ,max.y(),max.z());
-  } else if (dy >= dx && dy >= dz) {
-    split_axis = 1;
-    split_value = min.y()+dy/2.0;
-    min1 = Vec3f(min.x(),min.y()    ,min.z());
-    max1 = Vec3f(max.x(),split_value,max.z());
-    min2 = Vec3f(min.x(),split_value,min.z());
-    max2 = Vec3f(max.x(),max.y()    ,max.z());
-  } else {
-    assert (dz >= dx && dz >= dy);
-    split_axis = 2;
-    split_value = min.z()+dz/2.0;
-    min1 = Vec3f(min.x(),min.y(),min.z()    );
-    max1 = Vec3f(max.x(),max.y(),split_value);
-    min2 = Vec3f(min.x(),min.y(),split_value);
-    max2 = Vec3f(max.x(),max.y(),max.z()    );
+int KDTree::BucketRoot() const {
+  int levels = 0;
+  while ((1 << levels) - 1 < numPhotons()) levels++;
+  return (1 << std::max(0,levels - KDTREE_BUCKET_LEVELS)) - 1;
+}
+
+// Each level of the subtree is contiguous in the arrays: the whole
+// blocks of a level are tested where they are, the rest (the top
+// levels, which are narrower than a block) are gathered into blocks.
+int KDTree::CullBucket(int node, const Vec3f &point, const Vec3f *normal, double dist_sq,
+                       int indices[KDTREE_BUCKET_SIZE], float dists_sq[KDTREE_BUCKET_SIZE]) const {
+  const int block = DENSITY_KERNEL_BLOCK;
+  float p[3] = { float(point.x()), float(point.y()), float(point.z()) };
+  // (an unbounded radius mustn't become infinite, the unused lanes
+  // are infinitely far away)
+  float radius_sq = float(std::min(dist_sq,double(std::numeric_limits<float>::max())));
+  float n[3] = { 0, 0, 0 };
+  if (normal != NULL) { for (int a = 0; a < 3; a++) { n[a] = (*normal)[a]; } }
+  const KDTree *lane_trees[block];
+  for (int j = 0; j < block; j++) { lane_trees[j] = this; }
+  int run_indices[block];
+  int gather_indices[block];
+  alignas(32) float gather_position[3][block];
+  int gathered = 0;
+  int found = 0;
+  // (the lanes that pass go to the output)
+  auto test = [&](const PacketFloat position[3], const int lane_indices[]) {
+    PacketFloat d, mask;
+    int bits = CullPhotonBlock(position,p,(normal != NULL) ? n : NULL,radius_sq,lane_trees,lane_indices,d,mask);
+    if (bits == 0) return;
+    alignas(32) float lane_dists_sq[block];
+    d.Store(lane_dists_sq);
+    for (int j = 0; j < block; j++) {
+      if (!(bits & (1 << j))) continue;
+      indices[found] = lane_indices[j];
+      dists_sq[found] = lane_dists_sq[j];
+      found++;
+    }
+  };
+  auto flush = [&]() {
+    // (the unused lanes are far away)
+    for (int j = gathered; j < block; j++) {
+      gather_indices[j] = gather_indices[0];
+      for (int a = 0; a < 3; a++) { gather_position[a][j] = 1e30f; }
+    }
+    PacketFloat position[3];
+    for (int a = 0; a < 3; a++) { position[a] = PacketFloat::Load(gather_position[a]); }
+    test(position,gather_indices);
+    gathered = 0;
+  };
+
+  // the descendants of node l levels down are [(node+1)2^l - 1, (node+1)2^l - 1 + 2^l)
+  for (int l = 0; ; l++) {
+    int first = ((node+1) << l) - 1;
+    if (first >= numPhotons()) break;
+    int length = std::min(1 << l,numPhotons() - first);
+    for ( ; length >= block; first += block, length -= block) {
+      for (int j = 0; j < block; j++) { run_indices[j] = first + j; }
+      PacketFloat position[3];
+      for (int a = 0; a < 3; a++) { position[a] = PacketFloat::LoadUnaligned(coordinates[a] + first); }
+      test(position,run_indices);
+    }
+    for (int j = 0; j < length; j++) {
+      gather_indices[gathered] = first + j;
+      for (int a = 0; a < 3; a++) { gather_position[a][gathered] = coordinates[a][first + j]; }
+      if (++gathered == block) flush();
+    }
   }
-  // create two new children
-  child1 = new KDTree(BoundingBox(min1,max1),depth+1);
-  child2 = new KDTree(BoundingBox(min2,max2),depth+1);
-  int num_photons = photons.size();
-  std::vector<Photon> tmp = photons;
-  photons.clear();
-  // add all the photons to one of those children
-  for (int i = 0; i < num_photons; i++) {
-    const Photon &p = tmp[i];
-    this->AddPhoton(p);
+  if (gathered > 0) flush();
+  assert (found <= KDTREE_BUCKET_SIZE);
+  return found;
+}
+
+void KDTree::CollectNearestPhotons(const Vec3f &point, const Vec3f *normal, unsigned int k,
+                                   double max_dist_sq, std::vector<NearbyPhoton> &heap,
+                                   int index_offset) const {
+  CollectNearestPhotons(point,normal,k,max_dist_sq,heap,index_offset,[](int) { return true; });
+}
+
+// ==================================================================
+// VISUALIZATION
+
+void KDTree::CollectCells(std::vector<BoundingBox> &cells) const {
+  if (!built || numPhotons() == 0) return;
+  CollectCells(0,bbox,MAX_PHOTONS_PER_CELL,cells);
+}
+
+void KDTree::CollectCells(int node, const BoundingBox &cell, int max_photons, std::vector<BoundingBox> &cells) const {
+  if (node >= numPhotons()) return;
+  if (SubtreeSize(node) <= max_photons) {
+    cells.push_back(cell);
+    return;
   }
+  int axis = axes[node];
+  double split = getCoordinate(node,axis);
+  Vec3f max1 = cell.getMax();
+  Vec3f min2 = cell.getMin();
+  if (axis == 0) { max1.setx(split); min2.setx(split); }
+  else if (axis == 1) { max1.sety(split); min2.sety(split); }
+  else { max1.setz(split); min2.setz(split); }
+  CollectCells(2*node+1,BoundingBox(cell.getMin(),max1),max_photons,cells);
+  CollectCells(2*node+2,BoundingBox(min2,cell.getMax()),max_photons,cells);
+}
+
+int KDTree::numBoxes() const {
+  std::vector<BoundingBox> cells;
+  CollectCells(cells);
+  return cells.size();
 }
 
 // ==================================================================
@@ -1,27 +1,67 @@
 #ifndef _KDTREE_H_
 #define _KDTREE_H_
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstddef>
 #include <vector>
 #include "boundingbox.h"
 #include "photon.h"
 
 // ==================================================================
-// A hierarchical spatial data structure to store photons.  This data
-// struture allows for fast nearby neighbor queries for use in photon
-// mapping.
+// A photon found by a nearest neighbor query: its index in the tree
+// (see getPhoton) & its squared distance to the query point.  The
+// query keeps these in a max-heap, the farthest one first.
+
+struct NearbyPhoton {
+  int index;
+  double dist_sq;
+};
+
+inline bool operator< (const NearbyPhoton &a, const NearbyPhoton &b) {
+  return a.dist_sq < b.dist_sq;
+}
+
+// ==================================================================
+// A spatial data structure to store photons.  This data struture
+// allows for fast nearby neighbor queries for use in photon mapping.
+//
+// The photons are collected while they are traced, then Build sorts
+// them into a balanced kd-tree stored as a flat array in heap order
+// (no pointers): the children of node i are nodes 2i+1 & 2i+2, every
+// node is a photon, and the photon is the median of its subtree along
+// the split axis of the node.  The tree is left-balanced (every level
+// but the last is full, the last is filled from the left), so the
+// array has no holes.
+//
+// Once built, the tree is stored as a structure of arrays: the
+// coordinates & split axes a query walks over are packed together,
+// apart from the (packed) directions & energies of the photons, which
+// are only read for the photons the query is near to.  The arrays are
+// carved from one block of memory, which can be written to a file as
+// is & used straight from the mapped file (see PhotonMapFile).
+
+// the arrays of the tree start on a cache line
+#define KDTREE_ALIGNMENT 64
+// the nodes a range query has yet to visit: at most one per level of
+// the tree (the sibling of a node on the path down) & the next one, and
+// a left-balanced tree of 2^31 photons is 31 levels deep
+#define KDTREE_STACK_SIZE 64
+// the subtrees this many levels high at the bottom of the tree are
+// handed to VisitRunsNearPoint's visitor whole, a level at a time (&
+// tested a block at a time by the nearest neighbor queries)
+#define KDTREE_BUCKET_LEVELS 5
+#define KDTREE_BUCKET_SIZE ((1 << KDTREE_BUCKET_LEVELS) - 1)
 
 class KDTree {
  public:
 
   // ========================
   // CONSTRUCTOR & DESTRUCTOR
-  KDTree(const BoundingBox &_bbox, int _depth=0) {
-    bbox = _bbox;
-    depth = _depth;
-    child1=NULL;
-    child2=NULL;      
-  }
+  KDTree(const BoundingBox &_bbox);
+  // a built tree over num_photons photons in the block of memory of
+  // another tree (see getData), which must outlive this one
+  KDTree(const BoundingBox &_bbox, int num_photons, const char *data);
   ~KDTree();
 
   // =========
@@ -29,41 +69,270 @@ class KDTree {
   // boundingbox
   const Vec3f& getMin() const { return bbox.getMin(); }
   const Vec3f& getMax() const { return bbox.getMax(); }
-  bool overlaps(const BoundingBox &bb) const;
-  // hierarchy
-  int getDepth() const { return depth; }
-  bool isLeaf() const { 
-    if (child1==NULL&&child2==NULL) return true;
-    assert (child1 != NULL && child2 != NULL);
-    return false; }
-  const KDTree* getChild1() const { assert (!isLeaf()); assert (child1 != NULL); return child1; }
-  const KDTree* getChild2() const { assert (!isLeaf()); assert (child2 != NULL); return child2; }
-  // photons
-  const std::vector<Photon>& getPhotons() const { return photons; }
+  // photons (in heap order, once the tree is built)
+  int numPhotons() const { return built ? num_photons : photons.size(); }
+  Photon getPhoton(int i) const;
+  Vec3f getPosition(int i) const {
+    assert (built); return Vec3f(coordinates[0][i],coordinates[1][i],coordinates[2][i]); }
+  Vec3f getDirectionFrom(int i) const { assert (built); return UnpackDirection(directions[i]); }
+  Vec3f getEnergy(int i) const { assert (built); return UnpackRGBE(energies[i]); }
+  int whichBounce(int i) const { assert (built); return bounces[i]; }
+  // the packed fields
+  const float* getCoordinates(int axis) const { assert (built); return coordinates[axis]; }
+  unsigned short getPackedDirectionFrom(int i) const { return directions[i]; }
+  unsigned int getPackedEnergy(int i) const { return energies[i]; }
+  bool isBuilt() const { return built; }
+  // Call visit(i) with the index of each photon in the box (or within
+  // sqrt(dist_sq) of the point), in no particular order.  No photon is
+  // copied & nothing is allocated, the nodes to check wait on a fixed
+  // size stack.
+  template <class Visitor> void VisitPhotonsInBox(const BoundingBox &bb, Visitor visit) const;
+  template <class Visitor> void VisitPhotonsInRadius(const Vec3f &point, double dist_sq, Visitor visit) const;
+  // Call visit(i) for every photon the walk down to the photons within
+  // sqrt(dist_sq) of the point passes, leaving the distance test to
+  // the caller (see DensityKernel).
+  template <class Visitor> void VisitPhotonsNearPoint(const Vec3f &point, double dist_sq, Visitor visit) const;
+  // The same, but calling visit(first,length) with runs of photons:
+  // single photons down the tree, and near the bottom each level of a
+  // small subtree, which is contiguous in the arrays (the photons of a
+  // run can be tested together, see DensityKernel).
+  template <class Visitor> void VisitRunsNearPoint(const Vec3f &point, double dist_sq, Visitor visit) const;
   void CollectPhotonsInBox(const BoundingBox &bb, std::vector<Photon> &photons) const;
   int CountPhotonsInBox(const BoundingBox &bb) const;
+  // Add the photons near the point to the max-heap of the (at most k)
+  // nearest photons found so far, which may already hold photons from
+  // another query (e.g. through a portal).  Only photons within
+  // sqrt(max_dist_sq) count, and, if normal isn't NULL, only photons
+  // that arrived at the front of the surface.  The search radius
+  // shrinks to the farthest photon in the heap once it is full.  The
+  // photons are numbered from index_offset in the heap, so the photons
+  // of two trees can share it.  The small subtrees at the bottom are
+  // culled with SIMD blocks (see CullBucket), not photon by photon.
+  void CollectNearestPhotons(const Vec3f &point, const Vec3f *normal, unsigned int k,
+                             double max_dist_sq, std::vector<NearbyPhoton> &heap,
+                             int index_offset = 0) const;
+  // as above, but photon i only counts if accept(i) is true
+  template <class Accept> void CollectNearestPhotons(const Vec3f &point, const Vec3f *normal, unsigned int k,
+                                                     double max_dist_sq, std::vector<NearbyPhoton> &heap,
+                                                     int index_offset, Accept accept) const;
+  // the number & the total energy of the photons within sqrt(dist_sq)
+  // of the point (that arrived at the front of the surface, if normal
+  // isn't NULL)
+  int SumPhotonsInRadius(const Vec3f &point, const Vec3f *normal, double dist_sq, Vec3f &energy) const;
+  // for visualization: the cells of the subtrees small enough to be
+  // the leaves of a bucketed tree
+  void CollectCells(std::vector<BoundingBox> &cells) const;
+  int numBoxes() const;
+  // the block of memory holding the built tree
+  const char* getData() const { assert (built); return data; }
+  static size_t DataSize(int num_photons);
 
   // =========
   // MODIFIERS
+  // add a photon to the (not yet built) tree
   void AddPhoton(const Photon &p);
-  bool PhotonInCell(const Photon &p);
+  void AddPhotons(const std::vector<Photon> &p);
+  // sort the photons into the tree, the top levels in parallel
+  void Build(int num_threads = 1);
 
-  int numPhotons() const;
-  int numBoxes() const;
-  
  private:
 
-  // HELPER FUNCTION
-  void SplitCell();
+  // don't copy the arrays
+  KDTree(const KDTree&);
+  KDTree& operator=(const KDTree&);
+
+  // HELPER FUNCTIONS
+  void CarveArrays(char *block);
+  void BuildSubtree(std::vector<Photon> &input, int start, int end, int node, int num_threads);
+  template <class Accept> void CollectNearestPhotons(int node, int bucket, const Vec3f &point, const Vec3f *normal,
+                                                     unsigned int k, double &dist_sq, std::vector<NearbyPhoton> &heap,
+                                                     int index_offset, Accept &accept) const;
+  // the photons of the bottom subtree at node within sqrt(dist_sq) of
+  // the point (that arrived at the front of the surface, if normal
+  // isn't NULL): their indices & squared distances, returns how many
+  int CullBucket(int node, const Vec3f &point, const Vec3f *normal, double dist_sq,
+                 int indices[KDTREE_BUCKET_SIZE], float dists_sq[KDTREE_BUCKET_SIZE]) const;
+  // the index of the first root of the subtrees at the bottom
+  int BucketRoot() const;
+  void CollectCells(int node, const BoundingBox &cell, int max_photons, std::vector<BoundingBox> &cells) const;
+  int SubtreeSize(int node) const;
+
+  double getCoordinate(int i, int axis) const { return coordinates[axis][i]; }
 
   // REPRESENTATION
   BoundingBox bbox;
-  KDTree* child1;
-  KDTree* child2;
-  int split_axis;
-  float split_value;
+  // the photons added, until the tree is built
   std::vector<Photon> photons;
-  int depth;
+  // the tree: the allocation the arrays are carved from (NULL if the
+  // block belongs to someone else), the block (KDTREE_ALIGNMENT
+  // aligned) & the arrays
+  char *storage;
+  char *data;
+  float *coordinates[3];
+  unsigned char *axes;
+  unsigned short *directions;
+  unsigned int *energies;
+  unsigned char *bounces;
+  int num_photons;
+  bool built;
 };
 
+// ==================================================================
+// RANGE QUERIES
+
+template <class Visitor>
+void KDTree::VisitPhotonsInBox(const BoundingBox &bb, Visitor visit) const {
+  assert (built);
+  int n = numPhotons();
+  if (n == 0) return;
+  double min[3], max[3];
+  for (int a = 0; a < 3; a++) {
+    min[a] = bb.getMin()[a];
+    max[a] = bb.getMax()[a];
+  }
+  int todo[KDTREE_STACK_SIZE];
+  int count = 0;
+  todo[count++] = 0;
+  while (count > 0) {
+    int node = todo[--count];
+    double x = coordinates[0][node], y = coordinates[1][node], z = coordinates[2][node];
+    if (x >= min[0] && x <= max[0] && y >= min[1] && y <= max[1] && z >= min[2] && z <= max[2]) {
+      visit(node);
+    }
+    // the left subtree is at or below the split, the right at or above
+    int axis = axes[node];
+    double split = coordinates[axis][node];
+    if (2*node+2 < n && max[axis] >= split) todo[count++] = 2*node+2;
+    if (2*node+1 < n && min[axis] <= split) todo[count++] = 2*node+1;
+    assert (count <= KDTREE_STACK_SIZE);
+  }
+}
+
+template <class Visitor>
+void KDTree::VisitPhotonsNearPoint(const Vec3f &point, double dist_sq, Visitor visit) const {
+  assert (built);
+  int n = numPhotons();
+  if (n == 0) return;
+  double p[3] = { point.x(), point.y(), point.z() };
+  int todo[KDTREE_STACK_SIZE];
+  int count = 0;
+  todo[count++] = 0;
+  while (count > 0) {
+    int node = todo[--count];
+    visit(node);
+    int axis = axes[node];
+    double delta = p[axis] - coordinates[axis][node];
+    if (2*node+2 < n && (delta >= 0 || delta * delta <= dist_sq)) todo[count++] = 2*node+2;
+    if (2*node+1 < n && (delta <= 0 || delta * delta <= dist_sq)) todo[count++] = 2*node+1;
+    assert (count <= KDTREE_STACK_SIZE);
+  }
+}
+
+template <class Visitor>
+void KDTree::VisitRunsNearPoint(const Vec3f &point, double dist_sq, Visitor visit) const {
+  assert (built);
+  int n = numPhotons();
+  if (n == 0) return;
+  int bucket = BucketRoot();
+  double p[3] = { point.x(), point.y(), point.z() };
+  int todo[KDTREE_STACK_SIZE];
+  int count = 0;
+  todo[count++] = 0;
+  while (count > 0) {
+    int node = todo[--count];
+    if (node >= bucket) {
+      // the descendants of node l levels down are [(node+1)2^l - 1, (node+1)2^l - 1 + 2^l)
+      for (int l = 0; ; l++) {
+        int first = ((node+1) << l) - 1;
+        if (first >= n) break;
+        visit(first,std::min(1 << l,n - first));
+      }
+      continue;
+    }
+    visit(node,1);
+    int axis = axes[node];
+    double delta = p[axis] - coordinates[axis][node];
+    if (2*node+2 < n && (delta >= 0 || delta * delta <= dist_sq)) todo[count++] = 2*node+2;
+    if (2*node+1 < n && (delta <= 0 || delta * delta <= dist_sq)) todo[count++] = 2*node+1;
+    assert (count <= KDTREE_STACK_SIZE);
+  }
+}
+
+template <class Visitor>
+void KDTree::VisitPhotonsInRadius(const Vec3f &point, double dist_sq, Visitor visit) const {
+  VisitPhotonsNearPoint(point,dist_sq,[&](int i) {
+      if ((getPosition(i) - point).LengthSq() <= dist_sq) visit(i); });
+}
+
+// ==================================================================
+// NEAREST NEIGHBORS
+
+template <class Accept>
+void KDTree::CollectNearestPhotons(const Vec3f &point, const Vec3f *normal, unsigned int k,
+                                   double max_dist_sq, std::vector<NearbyPhoton> &heap,
+                                   int index_offset, Accept accept) const {
+  assert (built);
+  assert (k > 0 && heap.size() <= k);
+  double dist_sq = max_dist_sq;
+  if (heap.size() == k) dist_sq = std::min(dist_sq,heap.front().dist_sq);
+  CollectNearestPhotons(0,BucketRoot(),point,normal,k,dist_sq,heap,index_offset,accept);
+}
+
+// (a photon within sqrt(dist_sq), into the heap of the k nearest)
+inline void AddNearbyPhoton(const NearbyPhoton &nearby, unsigned int k, double &dist_sq,
+                            std::vector<NearbyPhoton> &heap) {
+  if (heap.size() < k) {
+    heap.push_back(nearby);
+    std::push_heap(heap.begin(),heap.end());
+  } else {
+    std::pop_heap(heap.begin(),heap.end());
+    heap.back() = nearby;
+    std::push_heap(heap.begin(),heap.end());
+  }
+  if (heap.size() == k) dist_sq = heap.front().dist_sq;
+}
+
+// Visit the side of the split the point is on first, so the heap fills
+// with close photons early & the radius shrinks before the far side is
+// (perhaps) visited.  A subtree at the bottom is culled whole, then
+// its photons go into the heap in turn (the radius may shrink as they
+// do).
+template <class Accept>
+void KDTree::CollectNearestPhotons(int node, int bucket, const Vec3f &point, const Vec3f *normal,
+                                   unsigned int k, double &dist_sq, std::vector<NearbyPhoton> &heap,
+                                   int index_offset, Accept &accept) const {
+  if (node >= numPhotons()) return;
+  if (node >= bucket) {
+    int indices[KDTREE_BUCKET_SIZE];
+    float dists_sq[KDTREE_BUCKET_SIZE];
+    int found = CullBucket(node,point,normal,dist_sq,indices,dists_sq);
+    for (int i = 0; i < found; i++) {
+      if (dists_sq[i] <= dist_sq && accept(indices[i])) {
+        NearbyPhoton nearby = { index_offset + indices[i], dists_sq[i] };
+        AddNearbyPhoton(nearby,k,dist_sq,heap);
+      }
+    }
+    return;
+  }
+  int axis = axes[node];
+  double delta = point[axis] - getCoordinate(node,axis);
+  int near_child = (delta < 0) ? 2*node+1 : 2*node+2;
+  int far_child = (delta < 0) ? 2*node+2 : 2*node+1;
+
+  CollectNearestPhotons(near_child,bucket,point,normal,k,dist_sq,heap,index_offset,accept);
+
+  double d = (getPosition(node) - point).LengthSq();
+  if (d <= dist_sq && (normal == NULL || UnpackDirection(directions[node]).Dot3(*normal) < 0) &&
+      accept(node)) {
+    NearbyPhoton nearby = { index_offset + node, d };
+    AddNearbyPhoton(nearby,k,dist_sq,heap);
+  }
+
+  if (delta * delta <= dist_sq) {
+    CollectNearestPhotons(far_child,bucket,point,normal,k,dist_sq,heap,index_offset,accept);
+  }
+}
+
+// ==================================================================
+
 #endif
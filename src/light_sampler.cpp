@@ -0,0 +1,146 @@
+#include <algorithm>
+
+#include "light_sampler.h"
+#include "mesh.h"
+#include "face.h"
+#include "vertex.h"
+#include "material.h"
+#include "argparser.h"
+#include "boundingbox.h"
+#include "utils.h"
+
+// ==================================================================
+// CONSTRUCTION
+
+LightSampler::LightSampler(Mesh *m, ArgParser *a) {
+  mesh = m;
+  args = a;
+  // a portal can show a light to points behind it
+  use_orientation = (mesh->numPortals() == 0 && !args->mesh_data->intersect_backfacing);
+
+  const std::vector<Face*> &lights = mesh->getLights();
+  int num_lights = lights.size();
+  double total = 0;
+  for (int i = 0; i < num_lights; i++) {
+    const Face *f = lights[i];
+    const Vec3f &emitted = f->getMaterial()->getEmittedColor();
+    double luminance = 0.2126 * emitted.r() + 0.7152 * emitted.g() + 0.0722 * emitted.b();
+    power.push_back(mymax(0.0,luminance) * f->getArea());
+    centroid.push_back(f->computeCentroid());
+    normal.push_back(f->computeNormal());
+    total += power.back();
+    cdf.push_back(total);
+  }
+  if (num_lights == 0) return;
+
+  std::vector<int> order(num_lights);
+  for (int i = 0; i < num_lights; i++) { order[i] = i; }
+  nodes.reserve(2 * num_lights - 1);
+  BuildTree(order,0,num_lights);
+}
+
+// Splits the lights at the median of their centroids along the axis
+// they are spread out most along.  Returns the index of the node.
+int LightSampler::BuildTree(std::vector<int> &lights, int start, int end) {
+  assert (end > start);
+  int index = nodes.size();
+  nodes.push_back(LightTreeNode());
+
+  const std::vector<Face*> &faces = mesh->getLights();
+  BoundingBox bbox((*faces[lights[start]])[0]->get());
+  BoundingBox centroids(centroid[lights[start]]);
+  double node_power = 0;
+  for (int i = start; i < end; i++) {
+    const Face *f = faces[lights[i]];
+    for (int j = 0; j < 4; j++) { bbox.Extend((*f)[j]->get()); }
+    centroids.Extend(centroid[lights[i]]);
+    node_power += power[lights[i]];
+  }
+
+  int light = -1;
+  int second = -1;
+  if (end - start == 1) {
+    light = lights[start];
+  } else {
+    Vec3f spread = centroids.getMax() - centroids.getMin();
+    int axis = 0;
+    if (spread.y() > spread[axis]) axis = 1;
+    if (spread.z() > spread[axis]) axis = 2;
+    int mid = (start + end) / 2;
+    std::nth_element(lights.begin()+start,lights.begin()+mid,lights.begin()+end,
+                     [this,axis](int a, int b) { return centroid[a][axis] < centroid[b][axis]; });
+    BuildTree(lights,start,mid);
+    second = BuildTree(lights,mid,end);
+  }
+
+  // (the recursion may have reallocated the array)
+  LightTreeNode &node = nodes[index];
+  for (int a = 0; a < 3; a++) {
+    node.min[a] = bbox.getMin()[a];
+    node.max[a] = bbox.getMax()[a];
+  }
+  node.power = node_power;
+  node.light = light;
+  node.second = second;
+  return index;
+}
+
+// ==================================================================
+// SAMPLING
+
+// The power over the squared distance to the center of the node,
+// clamped to the size of the node (inside or near a cluster of lights
+// the distance says little about which of them matters most).
+double LightSampler::Importance(const LightTreeNode &node, const Vec3f &point) const {
+  if (node.power <= 0) return 0;
+  if (node.light >= 0 && use_orientation &&
+      (point - centroid[node.light]).Dot3(normal[node.light]) <= 0) {
+    return 0;  // behind the light
+  }
+  double d2 = 0;
+  double r2 = 0;
+  for (int a = 0; a < 3; a++) {
+    double center = 0.5 * (node.min[a] + node.max[a]);
+    double half = 0.5 * (node.max[a] - node.min[a]);
+    d2 += (point[a] - center) * (point[a] - center);
+    r2 += half * half;
+  }
+  return node.power / mymax(d2,mymax(r2,1e-12));
+}
+
+int LightSampler::SampleLight(enum LIGHT_SAMPLING mode, const Vec3f &point, double &pdf) const {
+  pdf = 0;
+  int num_lights = power.size();
+  if (num_lights == 0 || cdf.back() <= 0) return -1;
+
+  if (mode == LIGHT_SAMPLING_POWER) {
+    double target = args->rand() * cdf.back();
+    int i = std::upper_bound(cdf.begin(),cdf.end(),target) - cdf.begin();
+    i = mymin(i,num_lights-1);
+    pdf = power[i] / cdf.back();
+    return i;
+  }
+
+  assert (mode == LIGHT_SAMPLING_TREE);
+  int index = 0;
+  pdf = 1;
+  if (Importance(nodes[0],point) <= 0) return -1;
+  while (nodes[index].light < 0) {
+    int first = index + 1;
+    int second = nodes[index].second;
+    double a = Importance(nodes[first],point);
+    double b = Importance(nodes[second],point);
+    if (a + b <= 0) return -1;
+    double p = a / (a + b);
+    if (args->rand() < p) {
+      index = first;
+      pdf *= p;
+    } else {
+      index = second;
+      pdf *= 1 - p;
+    }
+  }
+  return nodes[index].light;
+}
+
+// ==================================================================
@@ -0,0 +1,76 @@
+#ifndef _LIGHT_SAMPLER_H_
+#define _LIGHT_SAMPLER_H_
+
+#include <vector>
+#include "vectors.h"
+#include "meshdata.h"
+
+class Mesh;
+class ArgParser;
+
+// ==================================================================
+// A node of the light tree.  Leaves hold a single light, the first
+// child of an interior node is stored directly after its parent.
+
+struct LightTreeNode {
+  float min[3];
+  float max[3];
+  float power;   // the sum over the lights below
+  int light;     // leaf: index of the light, interior: -1
+  int second;    // interior: index of the second child
+};
+
+// ==================================================================
+// Picks the light to send a shadow ray to, in proportion to how much
+// it is expected to contribute, so that a fixed number of shadow rays
+// per point suffices however many lights the scene has.
+//
+// LIGHT_SAMPLING_POWER picks lights in proportion to their power
+// (emitted luminance x area), the same everywhere.
+// LIGHT_SAMPLING_TREE walks down a binary tree over the lights,
+// choosing between the two children in proportion to their power
+// divided by the squared distance to the point, and skips lights that
+// face away from it.  (Without portals: through a portal a light can
+// reach points it faces away from, so then orientation is ignored.)
+// Every light that can contribute has a non-zero probability, so
+// dividing by it keeps the estimate unbiased.
+
+class LightSampler {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  LightSampler(Mesh *m, ArgParser *a);
+
+  // =========
+  // ACCESSORS
+  int numLights() const { return power.size(); }
+
+  // Chooses a light for the point, returns its index (into
+  // Mesh::getLights) and the probability it was chosen with.  -1 if
+  // none of the lights can contribute.
+  int SampleLight(enum LIGHT_SAMPLING mode, const Vec3f &point, double &pdf) const;
+
+ private:
+
+  // HELPER FUNCTIONS
+  int BuildTree(std::vector<int> &lights, int start, int end);
+  double Importance(const LightTreeNode &node, const Vec3f &point) const;
+
+  // REPRESENTATION
+  Mesh *mesh;
+  ArgParser *args;
+  bool use_orientation;
+  // per light
+  std::vector<double> power;
+  std::vector<Vec3f> centroid;
+  std::vector<Vec3f> normal;
+  // running sum of the power, for LIGHT_SAMPLING_POWER
+  std::vector<double> cdf;
+  std::vector<LightTreeNode> nodes;
+};
+
+// ==================================================================
+
+#endif
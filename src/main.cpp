@@ -1,5 +1,6 @@
 #include "argparser.h"
 #include "meshdata.h"
+#include "batch_render.h"
 
 
 // =========================================================
@@ -24,6 +25,11 @@ int main(int argc, const char * argv[]) {
   mesh_data = &mymesh_data;
   ArgParser args(argc, argv, mesh_data);
 
+  // headless: render straight to a file, without opening a window
+  if (args.output_file != "") {
+    return BatchRender(&args);
+  }
+
   // launch the OS specific renderer
 #if __APPLE__
   return NSApplicationMain(argc, argv);
@@ -7,6 +7,8 @@
 #include "argparser.h"
 #include "vertex.h"
 #include "boundingbox.h"
+#include "bvh.h"
+#include "scene_snapshot.h"
 #include "mesh.h"
 #include "edge.h"
 #include "face.h"
@@ -46,6 +48,8 @@ Mesh::~Mesh() {
   for (i = 0; i < materials.size(); i++) { delete materials[i]; }
   for (i = 0; i < vertices.size(); i++) { delete vertices[i]; }
   delete bbox;
+  delete bvh;
+  delete snapshot;
 }
 
 // =======================================================================
@@ -301,6 +305,15 @@ void Mesh::Load(ArgParser *_args) {
     Vec3f up = Vec3f(0,1,0);
     camera = new PerspectiveCamera(camera_position, point_of_interest, up, 20 * M_PI/180.0);    
   }
+
+  // the geometry used for ray tracing doesn't change after loading
+  // (subdivision only affects the radiosity patches), compile it
+  // into the flat form used by the intersection tests
+  snapshot = new SceneSnapshot();
+  snapshot->Build(this);
+  bvh = new BVH();
+  bvh->Build(this);
+  bvh->PrintReport();
 }
 
 // =================================================================
@@ -15,6 +15,8 @@ class ArgParser;
 class Ray;
 class Hit;
 class Camera;
+class BVH;
+class SceneSnapshot;
 
 enum FACE_TYPE { FACE_TYPE_ORIGINAL, FACE_TYPE_RASTERIZED, FACE_TYPE_SUBDIVIDED };
 
@@ -31,7 +33,7 @@ public:
 
   // ===============================
   // CONSTRUCTOR & DESTRUCTOR & LOAD
-  Mesh() { bbox = NULL; }
+  Mesh() { bbox = NULL; bvh = NULL; snapshot = NULL; }
   virtual ~Mesh();
   void Load(ArgParser *_args);
     
@@ -113,6 +115,10 @@ public:
   // ===============
   // OTHER ACCESSORS
   BoundingBox* getBoundingBox() const { return bbox; }
+  // the flattened copy of the quads & the acceleration structure
+  // for ray tracing (both built by Load)
+  const SceneSnapshot* getSnapshot() const { return snapshot; }
+  const BVH* getBVH() const { return bvh; }
 
   // ===============
   // OTHER FUNCTIONS
@@ -141,6 +147,10 @@ private:
 
   // the bounding box of all rasterized faces in the scene
   BoundingBox *bbox; 
+  // the single precision quads (original & rasterized) for ray tracing
+  SceneSnapshot *snapshot;
+  // the hierarchy over quads, primitives, rasterized faces & portals
+  BVH *bvh;
 
   // the vertices & edges used by all quads (including rasterized primitives)
   std::vector<Vertex*> vertices;  
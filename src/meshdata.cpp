@@ -14,6 +14,7 @@
 #include "radiosity.h"
 #include "photon_mapping.h"
 #include "camera.h"
+#include "tile_renderer.h"
 
 // ====================================================================
 // ====================================================================
@@ -56,6 +57,7 @@ extern "C" {
     GLOBAL_args->raytracer->pixels_a.clear();
     GLOBAL_args->raytracer->pixels_b.clear();
     GLOBAL_args->raytracer->render_to_a = true;
+    GLOBAL_args->raytracer->getTileRenderer()->Reset();
   }
 
   void PhotonMappingClear() {
@@ -70,8 +72,8 @@ extern "C" {
     GLOBAL_args->Load();
   }
 
-  bool DrawPixel() {
-    return (bool)RayTraceDrawPixel();
+  bool DrawTiles() {
+    return (bool)RayTraceDrawTiles();
   }
 
   void cameraTranslate(float x, float y) {
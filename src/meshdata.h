@@ -32,6 +32,18 @@ typedef struct float16 {
 enum RENDER_MODE { RENDER_MATERIALS, RENDER_RADIANCE, RENDER_FORM_FACTORS, 
 		   RENDER_LIGHTS, RENDER_UNDISTRIBUTED, RENDER_ABSORBED };
 
+// WHICH LIGHTS GET SHADOW RAYS
+// ALL: every light, num_shadow_samples rays each
+// POWER & TREE: num_shadow_samples rays in total, each to one light
+// chosen in proportion to its power (POWER), or its power over the
+// squared distance (TREE, see LightSampler)
+enum LIGHT_SAMPLING { LIGHT_SAMPLING_ALL, LIGHT_SAMPLING_POWER, LIGHT_SAMPLING_TREE };
+
+// HOW THE PHOTONS OF A DENSITY ESTIMATE ARE WEIGHTED
+// BOX: all the same, CONE: falling off linearly with the distance,
+// EPANECHNIKOV: falling off with the squared distance (see DensityKernel)
+enum PHOTON_FILTER { PHOTON_FILTER_BOX, PHOTON_FILTER_CONE, PHOTON_FILTER_EPANECHNIKOV };
+
 typedef struct MeshData {
   
   // REPRESENTATION
@@ -53,15 +65,32 @@ typedef struct MeshData {
 
   // RAYTRACING PARAMETERS
   int num_bounces;
+  // paths through mirrors & portals whose throughput drops below the
+  // roulette threshold are continued at random (0 = off), below the
+  // cutoff they end (0 = off)
+  float russian_roulette_threshold;
+  float contribution_cutoff;
   int num_shadow_samples;
+  bool shuffle_light_strata;
+  enum LIGHT_SAMPLING light_sampling;
   int num_antialias_samples;
   int num_glossy_samples;
   float3 ambient_light;
   bool intersect_backfacing;
+  bool use_bvh;
+  bool use_packets;
+  int num_threads;
   int raytracing_divs_x;
   int raytracing_divs_y;
-  int raytracing_x;
-  int raytracing_y;
+  // the progressive display keeps adding samples to each pixel once
+  // the full resolution is reached, up to this many
+  int progressive_samples;
+  // adaptive antialiasing (off when adaptive_max_samples is 0)
+  int adaptive_min_samples;
+  int adaptive_max_samples;
+  float antialias_threshold;
+  float sample_budget;  // average samples per pixel, 0 = no limit
+  float time_budget;    // seconds, 0 = no limit
   
   // PORTAL PARAMETERS
   int portal_recursion_depth;
@@ -70,10 +99,26 @@ typedef struct MeshData {
   // PHOTON MAPPING PARAMETERS
   int num_photons_to_shoot;
   int num_photons_to_collect;
+  // a separate caustic map (0 photons = the caustics are in the one map)
+  int num_caustic_photons_to_shoot;
+  int num_caustic_photons_to_collect;
+  // only emit caustic photons towards specular surfaces
+  bool use_projection_maps;
+  // stochastic progressive photon mapping: passes of
+  // num_photons_to_shoot photons, the first gathered within this radius
+  // (0 = the radius of the num_photons_to_collect nearest photons)
+  int sppm_passes;
+  float sppm_initial_radius;
+  // only photons this close are collected (0 = no limit)
+  float photon_max_radius;
+  enum PHOTON_FILTER photon_filter;
   bool render_photons;
   bool render_photon_directions;
   bool render_kdtree;
   bool gather_indirect;
+  // interpolate the indirect light from an irradiance cache with this
+  // accuracy (see IrradianceCache, 0 = gather at every hit)
+  float irradiance_cache_accuracy;
 
   bool perspective;
   
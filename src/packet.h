@@ -0,0 +1,250 @@
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include <cmath>
+#include "ray.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define RAY_PACKET_SIZE 8
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAY_PACKET_SIZE 4
+#else
+#define RAY_PACKET_SIZE 4
+#define RAY_PACKET_SCALAR
+#endif
+
+#define RAY_PACKET_ALL_LANES ((1 << RAY_PACKET_SIZE) - 1)
+
+// ====================================================================
+// ====================================================================
+// One float per ray of a packet, in a single SIMD register (AVX: 8
+// lanes, SSE: 4 lanes, otherwise a plain array).  Comparisons return
+// a lane mask (all bits set where true) which can be combined with &
+// and |, or turned into one bit per lane with Bits().
+
+class PacketFloat {
+
+public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  PacketFloat() {}
+  PacketFloat(float f) {
+#if defined(__AVX__)
+    v = _mm256_set1_ps(f);
+#elif !defined(RAY_PACKET_SCALAR)
+    v = _mm_set1_ps(f);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) v[i] = f;
+#endif
+  }
+  // p must be aligned to the packet width
+  static PacketFloat Load(const float *p) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_load_ps(p);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_load_ps(p);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = p[i];
+#endif
+    return r;
+  }
+  static PacketFloat LoadUnaligned(const float *p) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_loadu_ps(p);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_loadu_ps(p);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = p[i];
+#endif
+    return r;
+  }
+  // p must be aligned to the packet width
+  void Store(float *p) const {
+#if defined(__AVX__)
+    _mm256_store_ps(p,v);
+#elif !defined(RAY_PACKET_SCALAR)
+    _mm_store_ps(p,v);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) p[i] = v[i];
+#endif
+  }
+
+  // =========
+  // ACCESSORS
+  // one bit per lane (set if the sign bit of the lane is set)
+  int Bits() const {
+#if defined(__AVX__)
+    return _mm256_movemask_ps(v);
+#elif !defined(RAY_PACKET_SCALAR)
+    return _mm_movemask_ps(v);
+#else
+    int bits = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) if (std::signbit(v[i])) bits |= 1 << i;
+    return bits;
+#endif
+  }
+
+  // ==========
+  // OPERATIONS
+#if defined(__AVX__)
+#define PACKET_BINARY_OP(op,intrinsic,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; r.v = _mm256_##intrinsic##_ps(a.v,b.v); return r; }
+#define PACKET_COMPARE_OP(op,cmp,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; r.v = _mm256_cmp_ps(a.v,b.v,cmp); return r; }
+#elif !defined(RAY_PACKET_SCALAR)
+#define PACKET_BINARY_OP(op,intrinsic,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; r.v = _mm_##intrinsic##_ps(a.v,b.v); return r; }
+#define PACKET_COMPARE_OP(op,cmp,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; r.v = _mm_##scalar##_ps(a.v,b.v); return r; }
+#else
+#define PACKET_BINARY_OP(op,intrinsic,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = scalar(a.v[i],b.v[i]); return r; }
+#define PACKET_COMPARE_OP(op,cmp,scalar) \
+  friend PacketFloat op(const PacketFloat &a, const PacketFloat &b) { \
+    PacketFloat r; for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = scalar(a.v[i],b.v[i]) ? -1.0f : 0.0f; return r; }
+#endif
+
+  PACKET_BINARY_OP(operator+,add,ScalarAdd)
+  PACKET_BINARY_OP(operator-,sub,ScalarSub)
+  PACKET_BINARY_OP(operator*,mul,ScalarMul)
+  PACKET_BINARY_OP(operator/,div,ScalarDiv)
+  PACKET_BINARY_OP(Min,min,ScalarMin)
+  PACKET_BINARY_OP(Max,max,ScalarMax)
+  PACKET_COMPARE_OP(operator<,_CMP_LT_OQ,cmplt)
+  PACKET_COMPARE_OP(operator<=,_CMP_LE_OQ,cmple)
+  PACKET_COMPARE_OP(operator>,_CMP_GT_OQ,cmpgt)
+  PACKET_COMPARE_OP(operator>=,_CMP_GE_OQ,cmpge)
+
+#undef PACKET_BINARY_OP
+#undef PACKET_COMPARE_OP
+
+  // bitwise operations on lane masks
+  friend PacketFloat operator&(const PacketFloat &a, const PacketFloat &b) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_and_ps(a.v,b.v);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_and_ps(a.v,b.v);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = (std::signbit(a.v[i]) && std::signbit(b.v[i])) ? -1.0f : 0.0f;
+#endif
+    return r;
+  }
+  friend PacketFloat operator|(const PacketFloat &a, const PacketFloat &b) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_or_ps(a.v,b.v);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_or_ps(a.v,b.v);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = (std::signbit(a.v[i]) || std::signbit(b.v[i])) ? -1.0f : 0.0f;
+#endif
+    return r;
+  }
+  // a in the lanes set in the mask, 0 in the others
+  friend PacketFloat Masked(const PacketFloat &mask, const PacketFloat &a) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_and_ps(mask.v,a.v);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_and_ps(mask.v,a.v);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = std::signbit(mask.v[i]) ? a.v[i] : 0.0f;
+#endif
+    return r;
+  }
+  friend PacketFloat Abs(const PacketFloat &a) { return Max(a, PacketFloat(0.0f) - a); }
+  friend PacketFloat Sqrt(const PacketFloat &a) {
+    PacketFloat r;
+#if defined(__AVX__)
+    r.v = _mm256_sqrt_ps(a.v);
+#elif !defined(RAY_PACKET_SCALAR)
+    r.v = _mm_sqrt_ps(a.v);
+#else
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) r.v[i] = std::sqrt(a.v[i]);
+#endif
+    return r;
+  }
+
+private:
+
+#ifdef RAY_PACKET_SCALAR
+  static float ScalarAdd(float a, float b) { return a+b; }
+  static float ScalarSub(float a, float b) { return a-b; }
+  static float ScalarMul(float a, float b) { return a*b; }
+  static float ScalarDiv(float a, float b) { return a/b; }
+  static float ScalarMin(float a, float b) { return a < b ? a : b; }
+  static float ScalarMax(float a, float b) { return a > b ? a : b; }
+  static bool cmplt(float a, float b) { return a < b; }
+  static bool cmple(float a, float b) { return a <= b; }
+  static bool cmpgt(float a, float b) { return a > b; }
+  static bool cmpge(float a, float b) { return a >= b; }
+#endif
+
+  // REPRESENTATION
+#if defined(__AVX__)
+  __m256 v;
+#elif !defined(RAY_PACKET_SCALAR)
+  __m128 v;
+#else
+  float v[RAY_PACKET_SIZE];
+#endif
+};
+
+// ====================================================================
+// ====================================================================
+// Up to RAY_PACKET_SIZE rays, stored in float "structure of arrays"
+// form for the SIMD tests.  The original (double) rays are kept for
+// the exact tests.  Unused lanes repeat the first ray.
+
+struct RayPacket {
+  int count;
+  const Ray *rays[RAY_PACKET_SIZE];
+  alignas(32) float orig[3][RAY_PACKET_SIZE];
+  alignas(32) float dir[3][RAY_PACKET_SIZE];
+  alignas(32) float inv_dir[3][RAY_PACKET_SIZE];
+
+  void Set(const Ray *r[], int n) {
+    assert (n > 0 && n <= RAY_PACKET_SIZE);
+    count = n;
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+      rays[i] = r[i < n ? i : 0];
+      const Vec3f &o = rays[i]->getOrigin();
+      const Vec3f &d = rays[i]->getDirection();
+      for (int a = 0; a < 3; a++) {
+        orig[a][i] = o[a];
+        // avoid 0 * infinity in the slab test
+        float da = d[a];
+        if (fabs(da) < 1e-20f) da = (da < 0) ? -1e-20f : 1e-20f;
+        dir[a][i] = da;
+        inv_dir[a][i] = 1.0f / da;
+      }
+    }
+  }
+  int activeLanes() const { return (1 << count) - 1; }
+  // do all the rays point into the same octant?  (then the nodes of
+  // the hierarchy can be visited in the same order for all of them)
+  bool isCoherent() const {
+    for (int a = 0; a < 3; a++) {
+      for (int i = 1; i < count; i++) {
+        if ((dir[a][i] < 0) != (dir[a][0] < 0)) return false;
+      }
+    }
+    return true;
+  }
+};
+
+// ====================================================================
+// ====================================================================
+
+#endif
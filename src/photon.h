@@ -1,30 +1,113 @@
 #ifndef _PHOTON_H_
 #define _PHOTON_H_
 
+#include <cmath>
 #include "vectors.h"
 
 // ===========================================================
-// Class to store the information when a photon hits a surface
+// Packing helpers for the compact photon record
+
+// Ward's shared exponent format: a byte of mantissa for each of red,
+// green & blue and the exponent of the largest, all in one int (about
+// 1% precision over a huge range, plenty for photon powers).
+inline unsigned int PackRGBE(const Vec3f &color) {
+  double v = color.r();
+  if (color.g() > v) v = color.g();
+  if (color.b() > v) v = color.b();
+  if (v < 1e-32) return 0;
+  int e;
+  double scale = frexp(v,&e) * 256.0 / v;
+  unsigned int answer = (unsigned int)(e + 128) << 24;
+  for (int c = 0; c < 3; c++) {
+    int m = (int)(color[c] * scale + 0.5);
+    if (m < 0) m = 0;
+    if (m > 255) m = 255;
+    answer |= (unsigned int)m << (8*c);
+  }
+  return answer;
+}
+
+inline Vec3f UnpackRGBE(unsigned int rgbe) {
+  int e = rgbe >> 24;
+  if (e == 0) return Vec3f(0,0,0);
+  double f = ldexp(1.0, e - (128+8));
+  return Vec3f(f * (rgbe & 255), f * ((rgbe >> 8) & 255), f * ((rgbe >> 16) & 255));
+}
+
+// A unit vector as its spherical angles, a byte each (Jensen).  The
+// sines & cosines of the 256 angles are tabulated, so unpacking costs
+// no trig.
+inline unsigned short PackDirection(const Vec3f &direction) {
+  Vec3f d = direction;
+  d.Normalize();
+  int theta = (int)(acos(d.z() < -1 ? -1 : (d.z() > 1 ? 1 : d.z())) * (256.0 / M_PI));
+  double angle = atan2(d.y(),d.x());
+  if (angle < 0) angle += 2 * M_PI;
+  int phi = (int)(angle * (256.0 / (2 * M_PI)));
+  if (theta > 255) theta = 255;
+  if (phi > 255) phi = 255;
+  return (unsigned short)((theta << 8) | phi);
+}
+
+struct DirectionTable {
+  DirectionTable() {
+    for (int i = 0; i < 256; i++) {
+      double theta = (i + 0.5) * (M_PI / 256.0);
+      double phi = (i + 0.5) * (2 * M_PI / 256.0);
+      cos_theta[i] = cos(theta); sin_theta[i] = sin(theta);
+      cos_phi[i] = cos(phi); sin_phi[i] = sin(phi);
+    }
+  }
+  double cos_theta[256], sin_theta[256], cos_phi[256], sin_phi[256];
+};
+
+inline Vec3f UnpackDirection(unsigned short direction) {
+  static const DirectionTable table;
+  int theta = direction >> 8;
+  int phi = direction & 255;
+  return Vec3f(table.sin_theta[theta] * table.cos_phi[phi],
+               table.sin_theta[theta] * table.sin_phi[phi],
+               table.cos_theta[theta]);
+}
+
+// ===========================================================
+// Class to store the information when a photon hits a surface.
+// Packed into 20 bytes (float position, RGBE energy, quantized
+// direction) so a large photon map stays small.
 
 class Photon {
  public:
 
-  // CONSTRUCTOR
-  Photon(const Vec3f &p, const Vec3f &d, const Vec3f &e, int b) :
-    position(p),direction_from(d),energy(e),bounce(b) {}
+  // CONSTRUCTORS
+  Photon(const Vec3f &p, const Vec3f &d, const Vec3f &e, int b) {
+    for (int a = 0; a < 3; a++) { position[a] = p[a]; }
+    energy = PackRGBE(e);
+    direction_from = PackDirection(d);
+    bounce = b > 255 ? 255 : b;
+  }
+  Photon(const float p[3], unsigned short d, unsigned int e, int b) {
+    for (int a = 0; a < 3; a++) { position[a] = p[a]; }
+    energy = e;
+    direction_from = d;
+    bounce = b;
+  }
 
   // ACCESSORS
-  const Vec3f& getPosition() const { return position; }
-  const Vec3f& getDirectionFrom() const { return direction_from; }
-  const Vec3f& getEnergy() const { return energy; }
+  Vec3f getPosition() const { return Vec3f(position[0],position[1],position[2]); }
+  Vec3f getDirectionFrom() const { return UnpackDirection(direction_from); }
+  Vec3f getEnergy() const { return UnpackRGBE(energy); }
   int whichBounce() const { return bounce; }
+  // the packed fields
+  float getCoordinate(int axis) const { return position[axis]; }
+  unsigned short getPackedDirectionFrom() const { return direction_from; }
+  unsigned int getPackedEnergy() const { return energy; }
 
  private:
   // REPRESENTATION
-  Vec3f position;
-  Vec3f direction_from;
-  Vec3f energy;
-  int bounce;
+  float position[3];
+  unsigned int energy;
+  unsigned short direction_from;
+  unsigned char bounce;
 };
 
 #endif
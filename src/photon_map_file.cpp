@@ -0,0 +1,160 @@
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "photon_map_file.h"
+#include "kdtree.h"
+#include "utils.h"
+
+static const char PHOTON_MAP_FILE_MAGIC[8] = { 'P','H','O','T','O','N','S','\n' };
+
+static inline uint64_t RoundUpToAlignment(uint64_t bytes) {
+  return (bytes + KDTREE_ALIGNMENT - 1) & ~uint64_t(KDTREE_ALIGNMENT - 1);
+}
+
+// whether [offset,offset+bytes) is within the file (written so that a
+// corrupted header can't wrap the sum around)
+static inline bool WithinFile(uint64_t offset, uint64_t bytes, uint64_t file_size) {
+  return offset <= file_size && bytes <= file_size - offset;
+}
+
+// ==================================================================
+// CONSTRUCTION
+
+PhotonMapFile::PhotonMapFile() {
+  mapped = NULL;
+  mapped_size = 0;
+  header = NULL;
+}
+
+PhotonMapFile::~PhotonMapFile() {
+  Close();
+}
+
+void PhotonMapFile::Close() {
+#if !defined(_WIN32)
+  if (mapped != NULL) munmap(const_cast<char*>(mapped),mapped_size);
+#endif
+  mapped = NULL;
+  mapped_size = 0;
+  header = NULL;
+}
+
+// ==================================================================
+// READING
+
+bool PhotonMapFile::Open(const std::string &filename, uint64_t key) {
+  Close();
+#if defined(_WIN32)
+  // (no mmap, the photons are traced every time)
+  return false;
+#else
+  int fd = open(filename.c_str(),O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd,&info) != 0 || info.st_size < (off_t)sizeof(PhotonMapFileHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void *m = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (m == MAP_FAILED) return false;
+  mapped = static_cast<const char*>(m);
+  mapped_size = size;
+  header = reinterpret_cast<const PhotonMapFileHeader*>(mapped);
+
+  // check everything before any of it is used
+  bool ok = (memcmp(header->magic,PHOTON_MAP_FILE_MAGIC,8) == 0 &&
+             header->version == PHOTON_MAP_FILE_VERSION &&
+             header->key == key &&
+             header->file_size == size &&
+             header->num_trees >= 1 && header->num_trees <= PHOTON_MAP_FILE_MAX_TREES);
+  for (unsigned int i = 0; ok && i < header->num_trees; i++) {
+    const PhotonMapFileTree &t = header->trees[i];
+    // (a count this large can't be in the file, and would overflow DataSize)
+    ok = (t.num_photons <= size && t.num_photons <= uint64_t(std::numeric_limits<int>::max()) &&
+          t.offset % KDTREE_ALIGNMENT == 0 &&
+          WithinFile(t.offset,KDTree::DataSize(t.num_photons),size));
+  }
+  ok = ok && (header->num_cache_records <= size / sizeof(IrradianceRecord) &&
+              header->num_cache_records <= uint64_t(std::numeric_limits<int>::max()) &&
+              header->cache_records_offset % KDTREE_ALIGNMENT == 0 &&
+              WithinFile(header->cache_records_offset,header->num_cache_records * sizeof(IrradianceRecord),size));
+  if (!ok) Close();
+  return ok;
+#endif
+}
+
+KDTree* PhotonMapFile::CreateTree(int i) const {
+  assert (header != NULL && i >= 0 && i < (int)header->num_trees);
+  const PhotonMapFileTree &t = header->trees[i];
+  BoundingBox bbox(Vec3f(t.min[0],t.min[1],t.min[2]),Vec3f(t.max[0],t.max[1],t.max[2]));
+  return new KDTree(bbox,t.num_photons,mapped + t.offset);
+}
+
+const IrradianceRecord& PhotonMapFile::getCacheRecord(int i) const {
+  assert (header != NULL && i >= 0 && i < (int)header->num_cache_records);
+  return reinterpret_cast<const IrradianceRecord*>(mapped + header->cache_records_offset)[i];
+}
+
+// ==================================================================
+// WRITING
+
+// The file is written next to its final name, then renamed, so no
+// other run ever maps half a file.
+bool PhotonMapFile::Write(const std::string &filename, uint64_t key,
+                          const std::vector<const KDTree*> &trees,
+                          const IrradianceCache *cache) {
+  assert (trees.size() >= 1 && trees.size() <= PHOTON_MAP_FILE_MAX_TREES);
+  PhotonMapFileHeader h;
+  memset(&h,0,sizeof(h));
+  memcpy(h.magic,PHOTON_MAP_FILE_MAGIC,8);
+  h.version = PHOTON_MAP_FILE_VERSION;
+  h.num_trees = trees.size();
+  h.key = key;
+  uint64_t offset = RoundUpToAlignment(sizeof(PhotonMapFileHeader));
+  for (unsigned int i = 0; i < trees.size(); i++) {
+    PhotonMapFileTree &t = h.trees[i];
+    t.num_photons = trees[i]->numPhotons();
+    t.offset = offset;
+    for (int a = 0; a < 3; a++) {
+      t.min[a] = trees[i]->getMin()[a];
+      t.max[a] = trees[i]->getMax()[a];
+    }
+    offset = RoundUpToAlignment(offset + KDTree::DataSize(t.num_photons));
+  }
+  int num_records = (cache != NULL) ? cache->numRecords() : 0;
+  h.num_cache_records = num_records;
+  h.cache_records_offset = offset;
+  h.file_size = offset + num_records * sizeof(IrradianceRecord);
+
+  std::string temporary = filename + ".tmp";
+  FILE *f = fopen(temporary.c_str(),"wb");
+  if (f == NULL) return false;
+  static const char zeros[KDTREE_ALIGNMENT] = { 0 };
+  bool ok = (fwrite(&h,sizeof(h),1,f) == 1);
+  uint64_t written = sizeof(h);
+  for (unsigned int i = 0; ok && i < trees.size(); i++) {
+    ok = (fwrite(zeros,1,h.trees[i].offset - written,f) == h.trees[i].offset - written);
+    size_t bytes = KDTree::DataSize(h.trees[i].num_photons);
+    ok = ok && (bytes == 0 || fwrite(trees[i]->getData(),bytes,1,f) == 1);
+    written = h.trees[i].offset + bytes;
+  }
+  ok = ok && (fwrite(zeros,1,h.cache_records_offset - written,f) == h.cache_records_offset - written);
+  for (int i = 0; ok && i < num_records; i++) {
+    ok = (fwrite(&cache->getRecord(i),sizeof(IrradianceRecord),1,f) == 1);
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (ok) ok = (rename(temporary.c_str(),filename.c_str()) == 0);
+  if (!ok) remove(temporary.c_str());
+  return ok;
+}
+
+// ==================================================================
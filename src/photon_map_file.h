@@ -0,0 +1,103 @@
+#ifndef _PHOTON_MAP_FILE_H_
+#define _PHOTON_MAP_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "irradiance_cache.h"
+
+class KDTree;
+
+// bump whenever the layout of the file (or of the kdtree block) changes
+#define PHOTON_MAP_FILE_VERSION 2
+#define PHOTON_MAP_FILE_MAX_TREES 4
+
+// ==================================================================
+// The file starts with this header, then the trees (the photon maps,
+// then their portal ghosts), each a KDTree block exactly as it is in
+// memory, then the irradiance cache records.
+// Every part starts at a multiple of KDTREE_ALIGNMENT.
+
+struct PhotonMapFileTree {
+  uint64_t num_photons;
+  uint64_t offset;
+  double min[3];
+  double max[3];
+};
+
+struct PhotonMapFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_trees;
+  // the hash of everything the photons depend on
+  uint64_t key;
+  uint64_t num_cache_records;
+  uint64_t cache_records_offset;
+  uint64_t file_size;
+  PhotonMapFileTree trees[PHOTON_MAP_FILE_MAX_TREES];
+};
+
+// ==================================================================
+// A photon map saved after tracing, so a later run (of an unchanged
+// scene, with the same photon parameters) can map the file & use the
+// trees in place instead of tracing the photons again.
+
+class PhotonMapFile {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  PhotonMapFile();
+  ~PhotonMapFile();
+
+  // map the file, false if it is missing or was written by another
+  // version or for another key
+  bool Open(const std::string &filename, uint64_t key);
+  // write the trees (all built) & the irradiance cache (may be NULL)
+  static bool Write(const std::string &filename, uint64_t key,
+                    const std::vector<const KDTree*> &trees,
+                    const IrradianceCache *cache);
+
+  // =========
+  // ACCESSORS
+  int numTrees() const { return header->num_trees; }
+  // a tree using the mapped memory (valid as long as this file is open)
+  KDTree* CreateTree(int i) const;
+  // the records of the irradiance cache, in the order they were added
+  int numCacheRecords() const { return header->num_cache_records; }
+  const IrradianceRecord& getCacheRecord(int i) const;
+
+ private:
+
+  // don't copy the mapping
+  PhotonMapFile(const PhotonMapFile&);
+  PhotonMapFile& operator=(const PhotonMapFile&);
+
+  void Close();
+
+  // REPRESENTATION
+  const char *mapped;
+  size_t mapped_size;
+  const PhotonMapFileHeader *header;
+};
+
+// ==================================================================
+// FNV-1a, to build the key of a photon map file
+
+inline uint64_t HashBytes(uint64_t hash, const void *bytes, size_t n) {
+  const unsigned char *b = static_cast<const unsigned char*>(bytes);
+  for (size_t i = 0; i < n; i++) {
+    hash ^= b[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+#define HASH_SEED 14695981039346656037ULL
+
+// ==================================================================
+
+#endif
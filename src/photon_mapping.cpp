@@ -1,6 +1,9 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <cstring>
+#include <limits>
+#include <thread>
 
 #include "argparser.h"
 #include "photon_mapping.h"
@@ -11,10 +14,20 @@
 #include "utils.h"
 #include "raytracer.h"
 #include "portal.h"
+#include "photon_map_file.h"
+#include "projection_map.h"
+#include "density_kernel.h"
 
 #define ENERGY_CUTOFF 0.01
 #define ITER_MAX 32
-#define GUESS_CONSTANT 1
+// the photons are emitted in chunks of this many, each traced by one
+// thread into its own buffer
+#define PHOTONS_PER_CHUNK 1024
+// irradiance cache records are valid within at most this fraction of
+// the scene's diagonal
+#define IRRADIANCE_CACHE_MAX_RADIUS 0.1
+// the validity radius of a record is found with this many squared rays
+#define IRRADIANCE_CACHE_RAYS 4
 
 static inline double randRange() {
   return 2 * GLOBAL_args->rand() - 1;
@@ -38,23 +51,27 @@ void PhotonMapping::Clear() {
   // cleanup all the photons
   delete kdtree;
   kdtree = NULL;
+  delete caustic_kdtree;
+  caustic_kdtree = NULL;
+  delete ghost_kdtree;
+  ghost_kdtree = NULL;
+  delete caustic_ghost_kdtree;
+  caustic_ghost_kdtree = NULL;
+  // (after the trees that use it)
+  delete map_file;
+  map_file = NULL;
+  delete irradiance_cache;
+  irradiance_cache = NULL;
+  cache_sites.clear();
 }
 
 
-struct PhotonData {
-  Photon photon;
-  double dist;
-};
-
-bool operator< (const PhotonData& p1, const PhotonData& p2) {
-  return p1.dist < p2.dist;
-}
-
 // ========================================================================
 // Recursively trace a single photon
 
 void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction, 
-                const Vec3f &energy, int iter) {
+                const Vec3f &energy, double initial_energy, int iter, bool specular_path,
+                enum PHOTON_MAP_TYPE type, PhotonBuffer &buffer) const {
   
   if(iter > ITER_MAX) return;
   
@@ -84,9 +101,11 @@ void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction,
     mesh->getPortalSide(portal).transferDirection(finalDirection);
   }
   
-  if(iter > 0) {
-    Photon photon(hitPoint, finalDirection, energy, iter);
-    kdtree->AddPhoton(photon);
+  if(iter > 0 && (type == PHOTON_MAP_ALL || specular_path == (type == PHOTON_MAP_CAUSTIC))) {
+    buffer.photons.push_back(Photon(hitPoint, finalDirection, energy, iter));
+    if(type != PHOTON_MAP_CAUSTIC && args->mesh_data->irradiance_cache_accuracy > 0) {
+      buffer.cache_sites.push_back({hitPoint, hit.getNormal()});
+    }
   }
   Vec3f reflectiveColor = hit.getMaterial()->getReflectiveColor();
   Vec3f diffuseColor = hit.getMaterial()->getDiffuseColor();
@@ -95,10 +114,12 @@ void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction,
   
   register double rLength = reflectiveEnergy.Length();
   
-  if(rLength > initialEnergy * ENERGY_CUTOFF) {
+  if(rLength > initial_energy * ENERGY_CUTOFF) {
     Vec3f reflectedRay = finalDirection - 2 * finalDirection.Dot3(hit.getNormal()) * hit.getNormal();
-    TracePhoton(hitPoint, reflectedRay, reflectiveEnergy, iter + 1);
+    TracePhoton(hitPoint, reflectedRay, reflectiveEnergy, initial_energy, iter + 1, specular_path, type, buffer);
   } else {
+    // (the caustic paths are over)
+    if(type == PHOTON_MAP_CAUSTIC) return;
     Vec3f diffuseRay = Vec3f(randRange(), randRange(), randRange());
     while(diffuseRay.Dot3(diffuseRay) < 0.0001) {
       diffuseRay = Vec3f(randRange(), randRange(), randRange());
@@ -106,7 +127,7 @@ void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction,
     
     diffuseRay.Normalize();
     if(diffuseRay.Dot3(hit.getNormal()) < 0) diffuseRay *= -1;
-    TracePhoton(hitPoint, diffuseRay, diffuseEnergy, iter + 1);
+    TracePhoton(hitPoint, diffuseRay, diffuseEnergy, initial_energy, iter + 1, false, type, buffer);
   }
 }
 
@@ -117,138 +138,441 @@ void PhotonMapping::TracePhoton(const Vec3f &position, const Vec3f &direction,
 void PhotonMapping::TracePhotons() {
 
   // first, throw away any existing photons
-  delete kdtree;
-  int photonsShot = 0;
+  Clear();
+
+  if (!args->photon_map_cache.empty() && LoadPhotonMaps()) return;
 
   // consruct a kdtree to store the photons
+  kdtree = new KDTree(PhotonBoundingBox());
+
+  // with a separate caustic map, the caustics get a photon budget of
+  // their own (& the global map leaves them out)
+  int num_caustic = args->mesh_data->num_caustic_photons_to_shoot;
+  if (num_caustic > 0) {
+    ShootPhotons(args->mesh_data->num_photons_to_shoot,PHOTON_MAP_GLOBAL,kdtree,0,&cache_sites);
+    caustic_kdtree = new KDTree(PhotonBoundingBox());
+    ShootPhotons(num_caustic,PHOTON_MAP_CAUSTIC,caustic_kdtree);
+    std::cout << "photon maps: " << kdtree->numPhotons() << " global, "
+              << caustic_kdtree->numPhotons() << " caustic photons" << std::endl;
+  } else {
+    ShootPhotons(args->mesh_data->num_photons_to_shoot,PHOTON_MAP_ALL,kdtree,0,&cache_sites);
+  }
+  ghost_kdtree = CollectGhosts(kdtree,args->mesh_data->num_photons_to_collect);
+  if (caustic_kdtree != NULL) {
+    caustic_ghost_kdtree = CollectGhosts(caustic_kdtree,args->mesh_data->num_caustic_photons_to_collect);
+  }
+  if (ghost_kdtree != NULL) {
+    std::cout << "portal ghosts: " << ghost_kdtree->numPhotons() << " photons" << std::endl;
+  }
+
+  if (args->mesh_data->irradiance_cache_accuracy > 0) {
+    BuildIrradianceCache();
+  }
+  if (!args->photon_map_cache.empty()) SavePhotonMaps();
+}
+
+BoundingBox PhotonMapping::PhotonBoundingBox() const {
   BoundingBox *bb = mesh->getBoundingBox();
   Vec3f min = bb->getMin();
   Vec3f max = bb->getMax();
   Vec3f diff = max-min;
   min -= 0.001f*diff;
   max += 0.001f*diff;
-  kdtree = new KDTree(BoundingBox(min,max));
+  return BoundingBox(min,max);
+}
+
+KDTree* PhotonMapping::TracePhotonPass(int num_photons, int pass) const {
+  KDTree *tree = new KDTree(PhotonBoundingBox());
+  ShootPhotons(num_photons,PHOTON_MAP_ALL,tree,pass);
+  return tree;
+}
+
+// (the photons of pass p are numbered after those of passes 0..p-1,
+// each photon has the random numbers of its number)
+void PhotonMapping::ShootPhotons(int num_photons, enum PHOTON_MAP_TYPE type, KDTree *tree,
+                                 int pass, std::vector<IrradianceCacheSite> *sites) const {
 
   // photons emanate from the light sources
   const std::vector<Face*>& lights = mesh->getLights();
 
-  // compute the total area of the lights
-  float total_lights_area = 0;
+  // caustic photons are only sent towards the specular surfaces
+  // (see projection_map.h)
+  std::vector<ProjectionMap> maps;
+  if (type == PHOTON_MAP_CAUSTIC && args->mesh_data->use_projection_maps) {
+    for (unsigned int i = 0; i < lights.size(); i++) {
+      maps.push_back(ProjectionMap(lights[i],mesh,raytracer,std::max(0,args->mesh_data->portal_recursion_depth)));
+    }
+  }
+
+  // the share of each light: its area (or, aimed with a projection
+  // map, the part of its area x emission that is aimed at)
+  std::vector<float> share;
+  float total_share = 0;
   for (unsigned int i = 0; i < lights.size(); i++) {
-    total_lights_area += lights[i]->getArea();
+    share.push_back(lights[i]->getArea());
+    if (!maps.empty()) share.back() *= maps[i].getCoverage();
+    total_share += share.back();
+  }
+  if (!maps.empty()) {
+    float total_area = 0;
+    for (unsigned int i = 0; i < lights.size(); i++) { total_area += lights[i]->getArea(); }
+    std::cout << "projection maps: " << 100 * total_share / total_area
+              << "% of the light aimed at specular surfaces" << std::endl;
   }
 
-  // shoot a constant number of photons per unit area of light source
-  // (alternatively, this could be based on the total energy of each light)
+  // shoot a constant number of photons per unit share of light source
+  // (alternatively, this could be based on the total energy of each
+  // light).  The photons are numbered across the lights, light i
+  // emits photons [first_photon[i],first_photon[i+1]).
+  std::vector<int> first_photon(1,0);
   for (unsigned int i = 0; i < lights.size(); i++) {  
-    float my_area = lights[i]->getArea();
-    int num = args->mesh_data->num_photons_to_shoot * my_area / total_lights_area;
-    // the initial energy for this photon
-    Vec3f energy = my_area/float(num) * lights[i]->getMaterial()->getEmittedColor();
-    Vec3f normal = lights[i]->computeNormal();
-    for (int j = 0; j < num; j++) {
-      Vec3f start = lights[i]->RandomPoint();
-      // the initial direction for this photon (for diffuse light sources)
-      initialEnergy = energy.Length();
-      Vec3f direction = RandomDiffuseDirection(normal);
-      TracePhoton(start,direction,energy,0);
-      ++photonsShot;
+    int num = (total_share > 0) ? int(num_photons * share[i] / total_share) : 0;
+    first_photon.push_back(first_photon.back() + num);
+  }
+  int total_photons = first_photon.back();
+
+  // Each photon has its own random stream, & the photons of a light
+  // are spread over a grid of strata on it, so the photons don't
+  // depend on which thread traces them.  The chunks are merged in
+  // order, so neither does the kdtree.
+  int num_chunks = (total_photons + PHOTONS_PER_CHUNK - 1) / PHOTONS_PER_CHUNK;
+  std::vector<PhotonBuffer> buffers(num_chunks);
+  std::atomic<int> next_chunk(0);
+  auto worker = [&]() {
+    int chunk;
+    while ((chunk = next_chunk.fetch_add(1)) < num_chunks) {
+      int first = chunk * PHOTONS_PER_CHUNK;
+      int last = std::min(first + PHOTONS_PER_CHUNK, total_photons);
+      int i = std::upper_bound(first_photon.begin(),first_photon.end(),first) - first_photon.begin() - 1;
+      for (int photon = first; photon < last; photon++) {
+        while (photon >= first_photon[i+1]) i++;
+        int num = first_photon[i+1] - first_photon[i];
+        int j = photon - first_photon[i];
+        int dimension = std::max(1,(int)sqrt(double(num)));
+        // the initial energy for this photon
+        Vec3f energy = share[i]/float(num) * lights[i]->getMaterial()->getEmittedColor();
+        args->SeedRandom(type == PHOTON_MAP_CAUSTIC ? RANDOM_STREAM_CAUSTIC_PHOTON : RANDOM_STREAM_PHOTON,
+                         uint64_t(pass) * num_photons + photon);
+        // (one photon per stratum, the photons left over are spread
+        // over the whole light, so no stratum gets more than its share)
+        Vec3f start = (j < dimension * dimension) ? lights[i]->RandomPoint(j % dimension, j / dimension, dimension)
+                                                  : lights[i]->RandomPoint();
+        // the initial direction for this photon (for diffuse light sources)
+        Vec3f direction = maps.empty() ? RandomDiffuseDirection(lights[i]->computeNormal())
+                                       : maps[i].RandomDirection();
+        TracePhoton(start,direction,energy,energy.Length(),0,true,type,buffers[chunk]);
+      }
+    }
+    RayTracer::FlushRayCount();
+  };
+  int num_threads = std::min(args->numThreads(),num_chunks);
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (unsigned int t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+
+  for (int c = 0; c < num_chunks; c++) {
+    tree->AddPhotons(buffers[c].photons);
+    if (sites != NULL) sites->insert(sites->end(),buffers[c].cache_sites.begin(),buffers[c].cache_sites.end());
+    // (free each buffer as soon as it is copied)
+    std::vector<Photon>().swap(buffers[c].photons);
+    std::vector<IrradianceCacheSite>().swap(buffers[c].cache_sites);
+  }
+
+  // sort the photons into the kdtree
+  tree->Build(args->numThreads());
+}
+
+// The photons depend on the scene file & the parameters that change
+// where they go (not on the camera or the image).  The irradiance
+// cache also depends on how the photons are gathered.
+std::string PhotonMapping::PhotonMapFilename(uint64_t &key) const {
+  key = HASH_SEED;
+  std::string scene = args->path + "/" + args->input_file;
+  FILE *f = fopen(scene.c_str(),"rb");
+  if (f != NULL) {
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer,1,sizeof(buffer),f)) > 0) { key = HashBytes(key,buffer,n); }
+    fclose(f);
+  }
+  const MeshData *m = args->mesh_data;
+  int parameters[] = { m->num_photons_to_shoot, m->num_caustic_photons_to_shoot,
+                       m->portal_recursion_depth, m->intersect_backfacing,
+                       m->sphere_horiz, m->sphere_vert, m->cylinder_ring_rasterization,
+                       m->use_projection_maps, int(args->seed),
+                       int(sizeof(Photon)), int(sizeof(IrradianceRecord)) };
+  key = HashBytes(key,parameters,sizeof(parameters));
+  if (m->portal_recursion_depth > 0) {
+    // (which photons have ghosts)
+    float ghosts[] = { m->photon_max_radius, float(m->num_photons_to_collect),
+                       float(m->num_caustic_photons_to_collect) };
+    key = HashBytes(key,ghosts,sizeof(ghosts));
+  }
+  if (m->irradiance_cache_accuracy > 0) {
+    float gathering[] = { m->irradiance_cache_accuracy, float(m->num_photons_to_collect), m->photon_max_radius,
+                          float(m->photon_filter) };
+    key = HashBytes(key,gathering,sizeof(gathering));
+  }
+  char name[64];
+  snprintf(name,sizeof(name),"/photons_%016llx.map",(unsigned long long)key);
+  return args->photon_map_cache + name;
+}
+
+bool PhotonMapping::LoadPhotonMaps() {
+  uint64_t key;
+  std::string filename = PhotonMapFilename(key);
+  map_file = new PhotonMapFile();
+  // the maps, then their ghosts (in the order SavePhotonMaps writes them)
+  bool caustics = (args->mesh_data->num_caustic_photons_to_shoot > 0);
+  bool ghosts = (args->mesh_data->portal_recursion_depth > 0 && mesh->numPortals() > 0);
+  int expected = (caustics ? 2 : 1) * (ghosts ? 2 : 1);
+  if (!map_file->Open(filename,key) || map_file->numTrees() != expected) {
+    delete map_file;
+    map_file = NULL;
+    return false;
+  }
+  int next = 0;
+  kdtree = map_file->CreateTree(next++);
+  if (caustics) caustic_kdtree = map_file->CreateTree(next++);
+  if (ghosts) {
+    ghost_kdtree = map_file->CreateTree(next++);
+    if (caustics) caustic_ghost_kdtree = map_file->CreateTree(next++);
+  }
+  if (args->mesh_data->irradiance_cache_accuracy > 0) {
+    BoundingBox bbox(kdtree->getMin(),kdtree->getMax());
+    irradiance_cache = new IrradianceCache(bbox,args->mesh_data->irradiance_cache_accuracy);
+    for (int i = 0; i < map_file->numCacheRecords(); i++) {
+      irradiance_cache->AddRecord(map_file->getCacheRecord(i));
     }
   }
+  std::cout << "photon maps loaded from " << filename << std::endl;
+  return true;
 }
 
+void PhotonMapping::SavePhotonMaps() const {
+  uint64_t key;
+  std::string filename = PhotonMapFilename(key);
+  std::vector<const KDTree*> trees(1,kdtree);
+  if (caustic_kdtree != NULL) trees.push_back(caustic_kdtree);
+  if (ghost_kdtree != NULL) trees.push_back(ghost_kdtree);
+  if (caustic_ghost_kdtree != NULL) trees.push_back(caustic_ghost_kdtree);
+  if (!PhotonMapFile::Write(filename,key,trees,irradiance_cache)) {
+    std::cout << "WARNING: could not save the photon maps to " << filename << std::endl;
+  }
+}
 
-// ======================================================================
+// The harmonic mean of the distances to the surfaces seen from the
+// point, along IRRADIANCE_CACHE_RAYS^2 stratified, cosine weighted
+// directions (the same directions at every point, so the cache is
+// built the same way every time).  Nothing in the way counts as
+// infinitely far.
+double PhotonMapping::HarmonicMeanDistance(const Vec3f &point, const Vec3f &normal) const {
+  Vec3f tangent = fabs(normal.x()) < 0.9 ? Vec3f(1,0,0) : Vec3f(0,1,0);
+  tangent -= tangent.Dot3(normal) * normal;
+  tangent.Normalize();
+  Vec3f bitangent;
+  Vec3f::Cross3(bitangent,normal,tangent);
+  double inverse_sum = 0;
+  for (int i = 0; i < IRRADIANCE_CACHE_RAYS; i++) {
+    for (int j = 0; j < IRRADIANCE_CACHE_RAYS; j++) {
+      double u = (i + 0.5) / IRRADIANCE_CACHE_RAYS;
+      double phi = 2 * M_PI * (j + 0.5) / IRRADIANCE_CACHE_RAYS;
+      Vec3f direction = sqrt(u) * cos(phi) * tangent + sqrt(u) * sin(phi) * bitangent + sqrt(1 - u) * normal;
+      Ray r(point,direction);
+      Hit h;
+      if (raytracer->CastRay(r,h,false)) inverse_sum += 1 / mymax(double(h.getT()),EPSILON);
+    }
+  }
+  if (inverse_sum <= 0) return std::numeric_limits<double>::max();
+  return IRRADIANCE_CACHE_RAYS * IRRADIANCE_CACHE_RAYS / inverse_sum;
+}
 
-// helper function
-bool closest_photon(const std::pair<Photon,float> &a, const std::pair<Photon,float> &b) {
-  return (a.second < b.second);
+// Fill the irradiance cache before rendering: visit the photon hits
+// in the order they were traced and add a record wherever none of
+// the records so far is valid.  (Records are only added here, so the
+// image doesn't depend on which thread renders which pixel first.)
+void PhotonMapping::BuildIrradianceCache() {
+  BoundingBox bbox(kdtree->getMin(),kdtree->getMax());
+  irradiance_cache = new IrradianceCache(bbox,args->mesh_data->irradiance_cache_accuracy);
+  for (unsigned int i = 0; i < cache_sites.size(); i++) {
+    Vec3f normal = cache_sites[i].normal;
+    normal.Normalize();
+    Vec3f irradiance;
+    if (irradiance_cache->Interpolate(cache_sites[i].position,normal,irradiance)) continue;
+    IrradianceRecord record;
+    EstimateIndirect(cache_sites[i].position,normal,&record);
+    if (record.radius > 0) irradiance_cache->AddRecord(record);
+  }
+  irradiance_cache->EstimateGradients();
+  if (args->verbose) {
+    std::cout << "irradiance cache: " << irradiance_cache->numRecords() << " records for "
+              << cache_sites.size() << " photon hits" << std::endl;
+  }
+  cache_sites.clear();
 }
 
 
 // ======================================================================
 
-void PhotonMapping::GatherThroughPortals(const Vec3f &point, const Vec3f &normal, const Vec3f &direction_from, double guess, const Vec3f& size, std::vector<PhotonData>& outPhotons) const {
-  outPhotons.clear();
-  std::vector<Photon> photons;
-  for(int i = 0; i < mesh->numPortals(); ++i) {
-    Vec3f p = point;
-    mesh->getPortalSide(i).transferPoint(p);
-    BoundingBox bb(p - guess * 0.5 * size, p + guess * 0.5 * size);
-    Vec3f min = bb.getMin();
-    Vec3f max = bb.getMax();
-    Vec3f centroid = mesh->getPortalSide(i).getCentroid();
-    if(centroid.x() <= min.x() || centroid.x() >= max.x() ||
-        centroid.y() <= min.y() || centroid.y() >= max.y() ||
-        centroid.z() <= min.z() || centroid.z() >= max.z()) continue;
-    
-    photons.clear();
-    
-    Vec3f n = normal;
-    mesh->getPortalSide(i).transferDirection(n);
-    
-    kdtree->CollectPhotonsInBox(bb, photons);
-    
-    for(int j = 0; j < photons.size(); ++j) {
-      register double minSize = size.x();
-      if(minSize > size.y()) minSize = size.y();
-      if(minSize > size.z()) minSize = size.z();
-      register double dist = (photons[j].getPosition() - p).LengthSq();
-      if(dist <= guess * minSize * guess * minSize * 0.25 &&
-          photons[j].getDirectionFrom().Dot3(n) < 0) {
-          Ray r(photons[j].getPosition(), p - photons[j].getPosition());
-          Vec3f res;
-          if(mesh->getPortalSide(i).getOtherSide()->intersectRay(r, res))outPhotons.push_back({photons[j], dist});
-          outPhotons.push_back({photons[j], dist});
-      }
+// ======================================================================
+
+// A photon near one side of a portal is also near the other side, as
+// seen through the portal.  The photons within the gather radius of a
+// side are copied through it once, into a tree of ghosts, so a gather
+// near a portal is just one more query (& needs no transforms).
+KDTree* PhotonMapping::CollectGhosts(const KDTree *tree, int num_photons_to_collect) const {
+  if (args->mesh_data->portal_recursion_depth <= 0 || mesh->numPortals() == 0) return NULL;
+  KDTree *ghosts = new KDTree(PhotonBoundingBox());
+  for (int s = 0; s < mesh->numPortalSides(); s++) {
+    const PortalSide &side = mesh->getPortalSide(s);
+    Vec3f a,b,c,d;
+    side.getCorners(a,b,c,d);
+    double radius = args->mesh_data->photon_max_radius;
+    if (radius <= 0) {
+      // a few times as far as the photons are gathered from around the
+      // middle of the side, but no farther than its corners
+      radius = 0.5 * (c - a).Length();
+      std::vector<NearbyPhoton> nearby;
+      unsigned int k = mymax(1,num_photons_to_collect);
+      tree->CollectNearestPhotons(side.getCentroid(),NULL,k,radius * radius,nearby);
+      if (nearby.size() == k) radius = mymin(radius,PORTAL_GHOST_RADIUS_SCALE * sqrt(nearby.front().dist_sq));
     }
+    // (only the photons in a box around the side are candidates)
+    BoundingBox box(a);
+    box.Extend(b);
+    box.Extend(c);
+    box.Extend(d);
+    Vec3f margin(radius,radius,radius);
+    tree->VisitPhotonsInBox(BoundingBox(box.getMin() - margin,box.getMax() + margin),[&](int i) {
+        // the distance to the nearest point of the side's square
+        Vec3f position = tree->getPosition(i);
+        Vec3f nearest = position;
+        side.getInverseTransform().Transform(nearest);
+        nearest.setx(mymax(-0.5,mymin(0.5,nearest.x())));
+        nearest.sety(mymax(-0.5,mymin(0.5,nearest.y())));
+        nearest.setz(0);
+        side.getTransform().Transform(nearest);
+        if ((nearest - position).LengthSq() > radius * radius) return;
+        side.transferPoint(position);
+        Vec3f direction = tree->getDirectionFrom(i);
+        side.transferDirection(direction);
+        float p[3] = { float(position.x()), float(position.y()), float(position.z()) };
+        ghosts->AddPhoton(Photon(p,PackDirection(direction),tree->getPackedEnergy(i),tree->whichBounce(i)));
+      });
   }
+  ghosts->Build(args->numThreads());
+  return ghosts;
 }
 
-Vec3f PhotonMapping::GatherIndirect(const Vec3f &point, const Vec3f &normal, const Vec3f &direction_from) const {
+Vec3f PhotonMapping::GatherIndirect(const Vec3f &point, const Vec3f &normal, const Vec3f &/*direction_from*/) const {
 
 
   if (kdtree == NULL) { 
     std::cout << "WARNING: Photons have not been traced throughout the scene." << std::endl;
     return Vec3f(0,0,0); 
   }
-  
-  unsigned int numToCollect = GLOBAL_args->mesh_data->num_photons_to_collect;
-  std::vector<Photon> photons;
-  std::vector<PhotonData> portalPhotons;
-  Vec3f size = kdtree->getMax() - kdtree->getMin();
-  
-  Vec3f energy(0, 0, 0);
-  double maxDistSq = 0;
-
-  double guess = GUESS_CONSTANT * (double)numToCollect / kdtree->numPhotons();
-  do {
-    guess *= 2;
-    BoundingBox bb(point - guess * 0.5 * size, point + guess * 0.5 * size);
-    kdtree->CollectPhotonsInBox(bb, photons);
-    
-    if(GLOBAL_args->mesh_data->portal_recursion_depth > 0) GatherThroughPortals(point, normal, direction_from, guess, size, portalPhotons);
-    portalPhotons.reserve(portalPhotons.size() + photons.size());
-    for(int i = 0; i < portalPhotons.size(); ++i) {
-      register double dist = (photons[i].getPosition() - point).LengthSq();
-      register double minSize = size.x();
-      if(minSize > size.y()) minSize = size.y();
-      if(minSize > size.z()) minSize = size.z();
-      if(dist <= guess * minSize * guess * minSize * 0.25 &&
-          photons[i].getDirectionFrom().Dot3(normal) < 0) portalPhotons.push_back({photons[i], dist});
-    }
-    
-  
-  if(portalPhotons.size() < numToCollect) continue;
-  
-  std::sort(portalPhotons.begin(), portalPhotons.end());
-  for(int i = 0; i < numToCollect; ++i){
-    energy += portalPhotons[i].photon.getEnergy();
+
+  Vec3f irradiance;
+  if (irradiance_cache == NULL || !irradiance_cache->Interpolate(point,normal,irradiance)) {
+    irradiance = EstimateIndirect(point,normal,NULL);
   }
-  maxDistSq = portalPhotons[numToCollect - 1].dist;
-  return 1 / (M_PI * maxDistSq) * energy;
-  
-  } while(true);
+  // the caustics are too sharp to interpolate
+  if (caustic_kdtree != NULL) {
+    double radius_sq;
+    irradiance += DensityEstimate(caustic_kdtree,caustic_ghost_kdtree,
+                                  args->mesh_data->num_caustic_photons_to_collect,
+                                  point,normal,radius_sq);
+  }
+  return irradiance;
+}
+
+// A ghost stands where its photon appears to be, seen through the
+// portal, so it only counts if the line of sight to it crosses the
+// square of the portal: the ghosts of the photons that are hidden by
+// the walls around the portal, or lie behind the surface the portal is
+// on, don't.  (The ghosts don't keep the side they were moved through,
+// any side will do.)
+bool PhotonMapping::SeenThroughPortal(const Vec3f &point, const Vec3f &ghost) const {
+  for (int s = 0; s < mesh->numPortalSides(); s++) {
+    // in the frame of the side, its square is [-0.5,0.5]^2 at z = 0
+    const Matrix &inverse = mesh->getPortalSide(s).getInverseTransform();
+    Vec3f a = point;
+    Vec3f b = ghost;
+    inverse.Transform(a);
+    inverse.Transform(b);
+    if ((a.z() < 0) == (b.z() < 0)) continue;
+    double t = a.z() / (a.z() - b.z());
+    double x = a.x() + t * (b.x() - a.x());
+    double y = a.y() + t * (b.y() - a.y());
+    if (fabs(x) <= 0.5 + PORTAL_GHOST_TOLERANCE && fabs(y) <= 0.5 + PORTAL_GHOST_TOLERANCE) return true;
+  }
+  return false;
+}
+
+Vec3f PhotonMapping::DensityEstimate(const KDTree *tree, const KDTree *ghosts, unsigned int k,
+                                      const Vec3f &point, const Vec3f &normal, double &radius_sq) const {
+  radius_sq = 0;
+  if (k == 0 || tree->numPhotons() == 0) return Vec3f(0,0,0);
+  double maxRadius = args->mesh_data->photon_max_radius;
+  double maxDistSq = (maxRadius > 0) ? maxRadius * maxRadius : std::numeric_limits<double>::max();
+
+  std::vector<NearbyPhoton> nearby;
+  nearby.reserve(k);
+  tree->CollectNearestPhotons(point, &normal, k, maxDistSq, nearby);
+  // (the ghosts are numbered after the photons of the tree)
+  int n = tree->numPhotons();
+  if (ghosts != NULL) {
+    ghosts->CollectNearestPhotons(point, &normal, k, maxDistSq, nearby, n,
+                                  [&](int i) { return SeenThroughPortal(point, ghosts->getPosition(i)); });
+  }
+  if (nearby.empty()) return Vec3f(0,0,0);
+
+  // the heap holds the farthest photon first.  (Too few photons within
+  // the cutoff are spread over the whole disk of that radius.)
+  if (nearby.size() == k || maxRadius <= 0) {
+    maxDistSq = nearby.front().dist_sq;
+  }
+  // (all of the photons found are right at the point: there's no disk
+  // to spread them over)
+  if (maxDistSq <= 0) return Vec3f(0,0,0);
+  radius_sq = maxDistSq;
+
+  // (the photons found have passed the normal test already)
+  DensityKernel kernel(point, NULL, maxDistSq, args->mesh_data->photon_filter);
+  for(unsigned int i = 0; i < nearby.size(); ++i){
+    int index = nearby[i].index;
+    if (index < n) kernel.Add(tree, index);
+    else kernel.Add(ghosts, index - n);
+  }
+  Vec3f energy;
+  kernel.Finish(energy);
+  return 1 / kernel.Area() * energy;
+}
+
+Vec3f PhotonMapping::EstimateIndirect(const Vec3f &point, const Vec3f &normal,
+                                      IrradianceRecord *record) const {
+  if (record != NULL) record->radius = 0;
+  double maxDistSq;
+  Vec3f irradiance = DensityEstimate(kdtree, ghost_kdtree, args->mesh_data->num_photons_to_collect,
+                                     point, normal, maxDistSq);
+  if (record != NULL && maxDistSq > 0) {
+    Vec3f n = normal;
+    n.Normalize();
+    record->position = point;
+    record->normal = n;
+    record->irradiance = irradiance;
+    // valid as far as the surrounding geometry is away (Ward's
+    // harmonic mean distance), but at least as far as the photons were
+    // collected from
+    double max_radius = IRRADIANCE_CACHE_MAX_RADIUS * (kdtree->getMax() - kdtree->getMin()).Length();
+    record->radius = mymax(sqrt(maxDistSq),mymin(max_radius,HarmonicMeanDistance(point,n)));
+  }
+  return irradiance;
 }
 
 // ======================================================================
@@ -261,12 +585,16 @@ int PhotonMapping::triCount() const {
     tri_count += kdtree->numBoxes()*12*12;
   if (GLOBAL_args->mesh_data->render_photon_directions == true && kdtree != NULL) 
     tri_count += kdtree->numPhotons()*12;
+  if (GLOBAL_args->mesh_data->render_photon_directions == true && caustic_kdtree != NULL) 
+    tri_count += caustic_kdtree->numPhotons()*12;
   return tri_count;
 }
 
 int PhotonMapping::pointCount() const {
   if (GLOBAL_args->mesh_data->render_photons == false || kdtree == NULL) return 0;
-  return kdtree->numPhotons();
+  int point_count = kdtree->numPhotons();
+  if (caustic_kdtree != NULL) point_count += caustic_kdtree->numPhotons();
+  return point_count;
 }
 
 // defined in raytree.cpp
@@ -275,13 +603,12 @@ void addBox(float* &current, Vec3f start, Vec3f end, Vec3f color, float width);
 // ======================================================================
 
 void packKDTree(const KDTree *kdtree, float* &current, int &count) {
-  if (!kdtree->isLeaf()) {
-    if (kdtree->getChild1() != NULL) { packKDTree(kdtree->getChild1(),current,count); }
-    if (kdtree->getChild2() != NULL) { packKDTree(kdtree->getChild2(),current,count); }
-  } else {
+  std::vector<BoundingBox> cells;
+  kdtree->CollectCells(cells);
+  for (unsigned int i = 0; i < cells.size(); i++) {
 
-    Vec3f a = kdtree->getMin();
-    Vec3f b = kdtree->getMax();
+    Vec3f a = cells[i].getMin();
+    Vec3f b = cells[i].getMax();
 
     Vec3f corners[8] = { Vec3f(a.x(),a.y(),a.z()),
                          Vec3f(a.x(),a.y(),b.z()),
@@ -315,37 +642,27 @@ void packKDTree(const KDTree *kdtree, float* &current, int &count) {
 
 // ======================================================================
 
-void packPhotons(const KDTree *kdtree, float* &current_points, int &count) {
-  if (!kdtree->isLeaf()) {
-      if (kdtree->getChild1() != NULL) { packPhotons(kdtree->getChild1(),current_points,count); }
-      if (kdtree->getChild2() != NULL) { packPhotons(kdtree->getChild2(),current_points,count); }
-  } else {
-    for (unsigned int i = 0; i < kdtree->getPhotons().size(); i++) {
-      const Photon &p = kdtree->getPhotons()[i];
-      Vec3f v = p.getPosition();
-      Vec3f color = p.getEnergy()*float(GLOBAL_args->mesh_data->num_photons_to_shoot);
-      float12 t = { float(v.x()),float(v.y()),float(v.z()),1,   0,0,0,0,   float(color.r()),float(color.g()),float(color.b()),1 };
-      memcpy(current_points, &t, sizeof(float)*12); current_points += 12; 
-      count++;
-    }
+// (the photon energies are scaled by the number of photons shot, to be
+// about as bright in any map)
+void packPhotons(const KDTree *kdtree, int num_shot, float* &current_points, int &count) {
+  for (int i = 0; i < kdtree->numPhotons(); i++) {
+    Vec3f v = kdtree->getPosition(i);
+    Vec3f color = kdtree->getEnergy(i)*float(num_shot);
+    float12 t = { float(v.x()),float(v.y()),float(v.z()),1,   0,0,0,0,   float(color.r()),float(color.g()),float(color.b()),1 };
+    memcpy(current_points, &t, sizeof(float)*12); current_points += 12; 
+    count++;
   }
 }
 
 
-void packPhotonDirections(const KDTree *kdtree, float* &current, int &count) {
-  if (!kdtree->isLeaf()) {
-      if (kdtree->getChild1() != NULL) { packPhotonDirections(kdtree->getChild1(),current,count); }
-      if (kdtree->getChild2() != NULL) { packPhotonDirections(kdtree->getChild2(),current,count); }
-  } else {
-    for (unsigned int i = 0; i < kdtree->getPhotons().size(); i++) {
-      const Photon &p = kdtree->getPhotons()[i];
-      Vec3f v = p.getPosition();
-      Vec3f v2 = p.getPosition() - p.getDirectionFrom() * 0.5;
-      Vec3f color = p.getEnergy()*float(GLOBAL_args->mesh_data->num_photons_to_shoot);
-      float width = 0.01;
-      addBox(current,v,v2,color,width);
-      count++;
-    }
+void packPhotonDirections(const KDTree *kdtree, int num_shot, float* &current, int &count) {
+  for (int i = 0; i < kdtree->numPhotons(); i++) {
+    Vec3f v = kdtree->getPosition(i);
+    Vec3f v2 = v - kdtree->getDirectionFrom(i) * 0.5;
+    Vec3f color = kdtree->getEnergy(i)*float(num_shot);
+    float width = 0.01;
+    addBox(current,v,v2,color,width);
+    count++;
   }
 }
   
@@ -356,14 +673,24 @@ void PhotonMapping::packMesh(float* &current, float* &current_points) {
   // the photons
   if (GLOBAL_args->mesh_data->render_photons && kdtree != NULL) {
     int count = 0;
-    packPhotons(kdtree,current_points,count);
+    packPhotons(kdtree,GLOBAL_args->mesh_data->num_photons_to_shoot,current_points,count);
     assert (count == kdtree->numPhotons());
+    if (caustic_kdtree != NULL) {
+      count = 0;
+      packPhotons(caustic_kdtree,GLOBAL_args->mesh_data->num_caustic_photons_to_shoot,current_points,count);
+      assert (count == caustic_kdtree->numPhotons());
+    }
   }
   // photon directions
   if (GLOBAL_args->mesh_data->render_photon_directions && kdtree != NULL) {
     int count = 0;
-    packPhotonDirections(kdtree,current,count);
+    packPhotonDirections(kdtree,GLOBAL_args->mesh_data->num_photons_to_shoot,current,count);
     assert (count == kdtree->numPhotons());
+    if (caustic_kdtree != NULL) {
+      count = 0;
+      packPhotonDirections(caustic_kdtree,GLOBAL_args->mesh_data->num_caustic_photons_to_shoot,current,count);
+      assert (count == caustic_kdtree->numPhotons());
+    }
   }
 
   // the wireframe kdtree
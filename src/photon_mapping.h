@@ -1,18 +1,48 @@
 #ifndef _PHOTON_MAPPING_H_
 #define _PHOTON_MAPPING_H_
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 #include "photon.h"
+#include "irradiance_cache.h"
+
+// without -photon_max_radius, the photons within this many times the
+// gather radius at the middle of a portal side get ghosts
+#define PORTAL_GHOST_RADIUS_SCALE 3
+// the slack (in the units of a portal side's square, which is 1 wide)
+// around the square the line of sight to a ghost must cross, so the
+// photons on a floor level with the edge of the portal count
+#define PORTAL_GHOST_TOLERANCE 0.01
 
 class Mesh;
 class ArgParser;
 class KDTree;
+class PhotonMapFile;
 class Ray;
 class Hit;
 class RayTracer;
 class Radiosity;
-struct PhotonData;
+struct NearbyPhoton;
+// =========================================================================
+// Which photons a pass of photon tracing stores: every photon (a single
+// map), or, for separate maps, the photons that reached a surface
+// straight from the light through specular bounces only (the caustic
+// map, the paths end at their first diffuse bounce) & all the others
+// (the global map).
+
+enum PHOTON_MAP_TYPE { PHOTON_MAP_ALL, PHOTON_MAP_GLOBAL, PHOTON_MAP_CAUSTIC };
+
+// =========================================================================
+// The photons (& irradiance cache sites) traced by one thread from one
+// chunk of the emitted photons, merged into the kdtree when all are done
+
+struct PhotonBuffer {
+  std::vector<Photon> photons;
+  std::vector<IrradianceCacheSite> cache_sites;
+};
+
 // =========================================================================
 // The basic class to shoot photons within the scene and collect and
 // process the nearest photons for use in the raytracer
@@ -27,6 +57,11 @@ class PhotonMapping {
     args = _args;
     raytracer = NULL;
     kdtree = NULL;
+    caustic_kdtree = NULL;
+    ghost_kdtree = NULL;
+    caustic_ghost_kdtree = NULL;
+    map_file = NULL;
+    irradiance_cache = NULL;
   }
   ~PhotonMapping() { Clear(); }
   void setRayTracer(RayTracer *r) { raytracer = r; }
@@ -34,7 +69,12 @@ class PhotonMapping {
 
   // step 1: send the photons throughout the scene
   void TracePhotons();
+  // one pass of progressive photon mapping: a new tree of
+  // num_photons photons (each pass shoots different photons), which
+  // the caller deletes
+  KDTree* TracePhotonPass(int num_photons, int pass) const;
   // step 2: collect the photons and return the contribution from indirect illumination
+  // (interpolated from the irradiance cache, where it is valid)
   Vec3f GatherIndirect(const Vec3f &point, const Vec3f &normal, const Vec3f &direction_from) const;
 
   void Clear();
@@ -45,18 +85,56 @@ class PhotonMapping {
   
  private:
 
-  // trace a single photon
-  void TracePhoton(const Vec3f &position, const Vec3f &direction, const Vec3f &energy, int iter);
+  // trace a single photon, storing where it lands in the buffers (of
+  // the calling thread)
+  void TracePhoton(const Vec3f &position, const Vec3f &direction, const Vec3f &energy,
+                   double initial_energy, int iter, bool specular_path,
+                   enum PHOTON_MAP_TYPE type, PhotonBuffer &buffer) const;
+  // shoot num_photons photons from the lights (in parallel), storing
+  // those of the type in the tree
+  void ShootPhotons(int num_photons, enum PHOTON_MAP_TYPE type, KDTree *tree,
+                    int pass = 0, std::vector<IrradianceCacheSite> *sites = NULL) const;
+  // the bounding box of the photons, a little larger than the scene
+  BoundingBox PhotonBoundingBox() const;
+  // the photon maps saved by an earlier run (see -photon_map_cache)
+  std::string PhotonMapFilename(uint64_t &key) const;
+  bool LoadPhotonMaps();
+  void SavePhotonMaps() const;
+  // the photons of the tree near each portal side, moved through it
+  // (NULL if photons aren't gathered through portals)
+  KDTree* CollectGhosts(const KDTree *tree, int num_photons_to_collect) const;
+  // whether the point sees the ghost through the square of a portal side
+  bool SeenThroughPortal(const Vec3f &point, const Vec3f &ghost) const;
+  // the density estimate of the k nearest photons of the tree & its
+  // ghosts (may be NULL), and the squared radius they were collected
+  // from
+  Vec3f DensityEstimate(const KDTree *tree, const KDTree *ghosts, unsigned int k, const Vec3f &point,
+                        const Vec3f &normal, double &radius_sq) const;
+  // the global photon density estimate (and, if record isn't NULL,
+  // the irradiance cache record for it)
+  Vec3f EstimateIndirect(const Vec3f &point, const Vec3f &normal, IrradianceRecord *record) const;
+  void BuildIrradianceCache();
+  double HarmonicMeanDistance(const Vec3f &point, const Vec3f &normal) const;
 
   // REPRESENTATION
+  // the global photon map (or all of the photons)
   KDTree *kdtree;
+  // the caustic photon map, if it is separate
+  KDTree *caustic_kdtree;
+  // the ghosts of the photons of each map near the portals, so the
+  // photons across a portal are found by one more query (see
+  // CollectGhosts)
+  KDTree *ghost_kdtree;
+  KDTree *caustic_ghost_kdtree;
+  // the file the maps are mapped from (if they were loaded)
+  PhotonMapFile *map_file;
+  IrradianceCache *irradiance_cache;
+  // where the photons landed, the candidate irradiance cache records
+  std::vector<IrradianceCacheSite> cache_sites;
   Mesh *mesh;
   ArgParser *args;
   RayTracer *raytracer;
   Radiosity *radiosity;
-  double initialEnergy;
-  
-  void GatherThroughPortals(const Vec3f &point, const Vec3f &normal, const Vec3f &direction_from, double guess, const Vec3f& size, std::vector<PhotonData>& outPhotons) const;
 };
 
 // =========================================================================
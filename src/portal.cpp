@@ -35,12 +35,17 @@ bool PortalSide::intersectRay(const Ray &ray, Vec3f &hit) const {
   if(t < 0.01) return false;
   hit = ray.pointAtParameter(t);
 
-  Vec3f localHit = hit;
-  inverseTransform.Transform(localHit);
+  SIMDVec3 localHit = localTransform.Transform(SIMDVec3(hit));
 
   return -0.5f <= localHit.x() && localHit.x() <= 0.5f && -0.5f <= localHit.y() && localHit.y() <= 0.5f;
 }
 
+bool PortalSide::occludes(const Ray &ray, float tmax) const {
+  Vec3f point;
+  if(!intersectRay(ray, point)) return false;
+  return (point - ray.getOrigin()).Length() < tmax;
+}
+
 bool PortalSide::intersectRay(const Ray &ray, Hit &hit) const {
   Vec3f point;
   bool success = intersectRay(ray, point);
@@ -3,6 +3,7 @@
 
 #include "vectors.h"
 #include "matrix.h"
+#include "simd_math.h"
 #include "ray.h"
 #include "hit.h"
 
@@ -15,6 +16,7 @@ public:
   void transferDirection(Vec3f &dir) const;
   bool intersectRay(const Ray &ray, Vec3f &hit) const;
   bool intersectRay(const Ray &ray, Hit &hit) const;
+  bool occludes(const Ray &ray, float tmax) const;
 
   const Matrix& getTransform() const { return transform; }
   const Matrix& getInverseTransform() const { return inverseTransform; }
@@ -38,6 +40,7 @@ private:
 
     myTransform.Inverse(inverseTransform);
     throughTransform = otherTransform * inverseTransform;
+    localTransform = SIMDMatrix(inverseTransform);
   };
 
   Matrix transform;
@@ -49,6 +52,8 @@ private:
   // Calculated from transform and cached
   Vec3f centroid;
   Vec3f normal;
+  // single precision inverseTransform, for the hit tests
+  SIMDMatrix localTransform;
 
   friend class Portal;
 };
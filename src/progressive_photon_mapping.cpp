@@ -0,0 +1,164 @@
+#include <iostream>
+#include <limits>
+
+#include "progressive_photon_mapping.h"
+#include "argparser.h"
+#include "meshdata.h"
+#include "mesh.h"
+#include "material.h"
+#include "raytracer.h"
+#include "photon_mapping.h"
+#include "tile_renderer.h"
+#include "kdtree.h"
+#include "portal.h"
+#include "image.h"
+#include "ray.h"
+#include "hit.h"
+#include "utils.h"
+
+// [0,1] -> [0,255]
+static inline int ColorToByte(double v) {
+  if (v < 0) v = 0;
+  if (v > 1) v = 1;
+  return int(v*255 + 0.5);
+}
+
+// ==================================================================
+
+void ProgressivePhotonMapping::RenderImage(Image &image) {
+  int width = args->mesh_data->width;
+  int height = args->mesh_data->height;
+  int passes = args->mesh_data->sppm_passes;
+  int num_photons = args->mesh_data->num_photons_to_shoot;
+  TileRenderer *tiles = args->raytracer->getTileRenderer();
+
+  SPPMPixel blank;
+  blank.direct = Vec3f(0,0,0);
+  blank.visible = false;
+  blank.radius_sq = 0;
+  blank.count = 0;
+  blank.flux = Vec3f(0,0,0);
+  pixels.assign(width*height,blank);
+
+  for (int pass = 0; pass < passes; pass++) {
+    // the visible points (& the direct light) of this pass
+    tiles->ParallelFor(height,1,[&](int y) {
+        for (int x = 0; x < width; x++) { TracePixel(x,y,pass); } });
+    // the photons of this pass, only kept while they are gathered
+    KDTree *tree = args->photon_mapping->TracePhotonPass(num_photons,pass);
+    tiles->ParallelFor(height,1,[&](int y) {
+        for (int x = 0; x < width; x++) { GatherPhotons(tree,pixels[y*width+x]); } });
+    delete tree;
+  }
+
+  image.Allocate(width,height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      Vec3f color = PixelColor(pixels[y*width+x],passes);
+      image.SetPixel(x,y,Color(ColorToByte(linear_to_srgb(color.r())),
+                               ColorToByte(linear_to_srgb(color.g())),
+                               ColorToByte(linear_to_srgb(color.b()))));
+    }
+  }
+  std::cout << "progressive photon mapping: " << passes << " passes of "
+            << num_photons << " photons" << std::endl;
+}
+
+// the first pass goes through the center of the pixel, the rest are
+// jittered (as the antialiasing samples)
+void ProgressivePhotonMapping::TracePixel(int x, int y, int pass) {
+  int width = args->mesh_data->width;
+  SPPMPixel &p = pixels[y*width+x];
+  args->SeedRandom(RANDOM_STREAM_SPPM, (uint64_t(pass) << 32) | uint64_t(y*width + x));
+  std::vector<Ray> rays;
+  GeneratePixelRays(x+0.5,y+0.5,pass,1,rays);
+  Hit hit;
+  p.direct += args->raytracer->TraceRay(rays[0],hit,args->mesh_data->num_bounces,
+                                        args->mesh_data->portal_recursion_depth);
+  FindVisiblePoint(rays[0],p);
+}
+
+// Follow the ray through mirrors (as far as the ray tracer follows
+// reflections) & portals to the first surface with a diffuse color.
+void ProgressivePhotonMapping::FindVisiblePoint(const Ray &ray, SPPMPixel &p) const {
+  p.visible = false;
+  Mesh *mesh = args->mesh;
+  Ray r = ray;
+  Vec3f weight(1,1,1);
+  int bounces = args->mesh_data->num_bounces;
+  int portals = args->mesh_data->portal_recursion_depth;
+  while (true) {
+    Hit h;
+    int portal = -1;
+    if (!args->raytracer->CastRay(r,h,false,portals > 0 ? &portal : NULL)) return;
+    Vec3f point = r.pointAtParameter(h.getT());
+    Vec3f direction = r.getDirection();
+    if (portal >= 0) {
+      mesh->getPortal(portal / 2).getSide(portal % 2).transferPoint(point);
+      mesh->getPortal(portal / 2).getSide(portal % 2).transferDirection(direction);
+      weight = weight * args->mesh_data->portal_tint;
+      portals--;
+      r = Ray(point,direction);
+      continue;
+    }
+    Material *m = h.getMaterial();
+    if (m->getEmittedColor().Length() > 0.001) return;
+    Vec3f diffuse = m->getDiffuseColor(h.get_s(),h.get_t());
+    if (diffuse.r() > 0 || diffuse.g() > 0 || diffuse.b() > 0) {
+      p.visible = true;
+      p.position = point;
+      p.normal = h.getNormal();
+      p.weight = weight * diffuse;
+      return;
+    }
+    Vec3f reflective = m->getReflectiveColor();
+    if (bounces <= 0 || (reflective.r() <= 0 && reflective.g() <= 0 && reflective.b() <= 0)) return;
+    Vec3f normal = h.getNormal();
+    weight = weight * reflective;
+    bounces--;
+    portals = args->mesh_data->portal_recursion_depth;
+    r = Ray(point,direction - 2 * direction.Dot3(normal) * normal);
+  }
+}
+
+// The progressive radiance estimate: of the M photons found within
+// the radius, only alpha M are counted, and the radius shrinks so the
+// count N matches (the flux collected so far is scaled to the smaller
+// disk).
+void ProgressivePhotonMapping::GatherPhotons(const KDTree *tree, SPPMPixel &p) const {
+  if (!p.visible) return;
+  if (p.radius_sq <= 0) {
+    // the first visible point: as far as the nearest photons (of the
+    // first pass it sees), unless the radius is given
+    double r = args->mesh_data->sppm_initial_radius;
+    if (r > 0) {
+      p.radius_sq = r * r;
+    } else {
+      std::vector<NearbyPhoton> nearby;
+      unsigned int k = mymax(1,args->mesh_data->num_photons_to_collect);
+      tree->CollectNearestPhotons(p.position,&p.normal,k,std::numeric_limits<double>::max(),nearby);
+      if (nearby.empty()) return;
+      p.radius_sq = nearby.front().dist_sq;
+    }
+  }
+  Vec3f energy;
+  int m = tree->SumPhotonsInRadius(p.position,&p.normal,p.radius_sq,energy);
+  if (m == 0) return;
+  double count = p.count + SPPM_ALPHA * m;
+  double shrink = count / (p.count + m);
+  p.radius_sq *= shrink;
+  p.count = count;
+  p.flux = shrink * (p.flux + p.weight * energy);
+}
+
+// each pass's photons carry all of the light's power, so the flux is
+// averaged over the passes
+Vec3f ProgressivePhotonMapping::PixelColor(const SPPMPixel &p, int passes) const {
+  Vec3f color = (1.0 / passes) * p.direct;
+  if (p.radius_sq > 0) {
+    color += (1.0 / (M_PI * p.radius_sq * passes)) * p.flux;
+  }
+  return color;
+}
+
+// ==================================================================
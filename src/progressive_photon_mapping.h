@@ -0,0 +1,73 @@
+#ifndef _PROGRESSIVE_PHOTON_MAPPING_H_
+#define _PROGRESSIVE_PHOTON_MAPPING_H_
+
+#include <vector>
+#include "vectors.h"
+
+class ArgParser;
+class KDTree;
+class Ray;
+class Image;
+
+// how quickly the gather radius shrinks (the fraction of the new
+// photons kept each pass)
+#define SPPM_ALPHA 0.7
+
+// ==================================================================
+// What a pixel keeps from pass to pass: the sum of its direct (ray
+// traced) light, and the photon statistics at its visible point.  The
+// visible point itself is found again every pass (with a jittered
+// ray), the statistics carry over.
+
+struct SPPMPixel {
+  Vec3f direct;
+  // this pass: the first diffuse surface along the camera ray (through
+  // mirrors & portals), and the color the light leaving it is
+  // multiplied by on the way to the camera
+  bool visible;
+  Vec3f position;
+  Vec3f normal;
+  Vec3f weight;
+  // the gather radius (squared, 0 until the first visible point), the
+  // number of photons counted & their (weighted) flux so far
+  double radius_sq;
+  double count;
+  Vec3f flux;
+};
+
+// ==================================================================
+// Stochastic progressive photon mapping (Hachisuka & Jensen 2009).
+// Each pass traces one jittered ray through every pixel, then shoots
+// a fixed number of photons into a temporary kdtree, adds those near
+// each visible point to the pixel's flux & shrinks the pixel's gather
+// radius, and throws the photons away.  Memory doesn't grow with the
+// number of passes, and the indirect light converges as passes are
+// added.  The direct light is ray traced, as in photon mapping.
+
+class ProgressivePhotonMapping {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  ProgressivePhotonMapping(ArgParser *_args) { args = _args; }
+
+  // render args->mesh_data->sppm_passes passes into the image
+  void RenderImage(Image &image);
+
+ private:
+
+  // HELPER FUNCTIONS
+  void TracePixel(int x, int y, int pass);
+  void FindVisiblePoint(const Ray &ray, SPPMPixel &p) const;
+  void GatherPhotons(const KDTree *tree, SPPMPixel &p) const;
+  Vec3f PixelColor(const SPPMPixel &p, int passes) const;
+
+  // REPRESENTATION
+  ArgParser *args;
+  std::vector<SPPMPixel> pixels;
+};
+
+// ==================================================================
+
+#endif
@@ -0,0 +1,104 @@
+#include <cmath>
+
+#include "projection_map.h"
+#include "argparser.h"
+#include "face.h"
+#include "material.h"
+#include "mesh.h"
+#include "portal.h"
+#include "raytracer.h"
+#include "ray.h"
+#include "hit.h"
+
+// ==================================================================
+// CONSTRUCTOR
+
+ProjectionMap::ProjectionMap(const Face *light, const Mesh *mesh, const RayTracer *raytracer, int portal_depth) {
+  Vec3f a = (*light)[0]->get();
+  Vec3f b = (*light)[1]->get();
+  Vec3f c = (*light)[2]->get();
+  Vec3f d = (*light)[3]->get();
+  normal = light->computeNormal();
+  tangent = b - a;
+  tangent.Normalize();
+  Vec3f::Cross3(bitangent,normal,tangent);
+
+  const int n = PROJECTION_MAP_RESOLUTION;
+  const int p = PROJECTION_MAP_PROBES;
+  // the probe rays start from a grid of points on the light (as
+  // Face::RandomPoint, without the jitter)
+  std::vector<Vec3f> starts;
+  for (int i = 0; i < p; i++) {
+    for (int j = 0; j < p; j++) {
+      double s = (i + 0.5) / p;
+      double t = (j + 0.5) / p;
+      starts.push_back(s*t*a + s*(1-t)*b + (1-s)*t*d + (1-s)*(1-t)*c);
+    }
+  }
+
+  std::vector<bool> hit_specular(n*n,false);
+  for (int cell = 0; cell < n*n; cell++) {
+    for (int k = 0; k < p*p && !hit_specular[cell]; k++) {
+      Vec3f direction = CellDirection(cell,(k % p + 0.5) / p,(k / p + 0.5) / p);
+      for (unsigned int i = 0; i < starts.size() && !hit_specular[cell]; i++) {
+        // (through the portals, as TracePhoton goes)
+        Ray ray(starts[i],direction);
+        for (int hops = portal_depth; hops >= 0; hops--) {
+          Hit h;
+          int portal = -1;
+          if (!raytracer->CastRay(ray,h,false,(hops > 0) ? &portal : NULL)) break;
+          if (portal < 0) {
+            const Vec3f &reflective = h.getMaterial()->getReflectiveColor();
+            hit_specular[cell] = (reflective.r() > 0 || reflective.g() > 0 || reflective.b() > 0);
+            break;
+          }
+          Vec3f origin = ray.pointAtParameter(h.getT());
+          Vec3f next = ray.getDirection();
+          mesh->getPortalSide(portal).transferPoint(origin);
+          mesh->getPortalSide(portal).transferDirection(next);
+          ray = Ray(origin,next);
+        }
+      }
+    }
+  }
+
+  // mark the cells that were hit & their neighbors (phi wraps around)
+  for (int u = 0; u < n; u++) {
+    for (int phi = 0; phi < n; phi++) {
+      bool mark = false;
+      for (int du = -1; du <= 1 && !mark; du++) {
+        if (u + du < 0 || u + du >= n) continue;
+        for (int dphi = -1; dphi <= 1 && !mark; dphi++) {
+          mark = hit_specular[(u + du) * n + (phi + dphi + n) % n];
+        }
+      }
+      if (mark) marked.push_back(u * n + phi);
+    }
+  }
+}
+
+// ==================================================================
+// SAMPLING
+
+// Malley's method: a uniform point on the unit disk (of radius
+// sqrt(u)), lifted to the hemisphere, is cosine distributed
+Vec3f ProjectionMap::CellDirection(int cell, double s, double t) const {
+  const int n = PROJECTION_MAP_RESOLUTION;
+  double u = (cell / n + s) / n;
+  double phi = 2 * M_PI * (cell % n + t) / n;
+  double r = sqrt(u);
+  Vec3f answer = r * cos(phi) * tangent + r * sin(phi) * bitangent + sqrt(1 - u) * normal;
+  answer.Normalize();
+  return answer;
+}
+
+Vec3f ProjectionMap::RandomDirection() const {
+  assert (!marked.empty());
+  int i = int(GLOBAL_args->rand() * marked.size());
+  if (i >= (int)marked.size()) i = marked.size() - 1;
+  double s = GLOBAL_args->rand();
+  double t = GLOBAL_args->rand();
+  return CellDirection(marked[i],s,t);
+}
+
+// ==================================================================
@@ -0,0 +1,62 @@
+#ifndef _PROJECTION_MAP_H_
+#define _PROJECTION_MAP_H_
+
+#include <vector>
+#include "vectors.h"
+
+class Face;
+class Mesh;
+class RayTracer;
+
+// the cells per side of the map, and the probe rays per side of a
+// cell (from as many points per side of the light)
+#define PROJECTION_MAP_RESOLUTION 64
+#define PROJECTION_MAP_PROBES 2
+
+// ==================================================================
+// Which directions out of a light reach a specular surface (Jensen's
+// projection map).  The cosine weighted hemisphere above the light is
+// split into cells of equal probability, a grid over (u,phi) where
+// the direction makes an angle of acos(sqrt(1-u)) with the normal.  A
+// cell is marked if a probe ray through it hits a reflective material
+// (followed through at most portal_depth portals), and so are its
+// neighbors, as the probes miss small objects between them.
+//
+// Caustic photons are only emitted into the marked cells; as all of
+// the cells are equally likely, each carries the light's power times
+// the fraction of the cells that are marked.
+
+class ProjectionMap {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR
+  ProjectionMap(const Face *light, const Mesh *mesh, const RayTracer *raytracer, int portal_depth);
+
+  // =========
+  // ACCESSORS
+  // the fraction of the light's emission that goes through the marked cells
+  double getCoverage() const {
+    return marked.size() / double(PROJECTION_MAP_RESOLUTION * PROJECTION_MAP_RESOLUTION); }
+  bool isEmpty() const { return marked.empty(); }
+  // a cosine distributed direction within a random marked cell (uses
+  // the random numbers of the calling thread)
+  Vec3f RandomDirection() const;
+
+ private:
+
+  // the direction at (s,t) within the cell, each in [0,1]
+  Vec3f CellDirection(int cell, double s, double t) const;
+
+  // REPRESENTATION
+  Vec3f normal;
+  Vec3f tangent;
+  Vec3f bitangent;
+  // the marked cells, as u * PROJECTION_MAP_RESOLUTION + phi
+  std::vector<int> marked;
+};
+
+// ==================================================================
+
+#endif
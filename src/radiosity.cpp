@@ -1,4 +1,5 @@
 #include "vectors.h"
+#include "simd_math.h"
 #include "radiosity.h"
 #include "mesh.h"
 #include "face.h"
@@ -108,12 +109,26 @@ void Radiosity::ComputeFormFactors() {
     formfactors[i] = 0;
   }
   
+  // the patch normals, so the loops below don't walk the half edges
+  std::vector<SIMDVec3> normals(num_faces);
+  for(int i = 0; i < num_faces; ++i) {
+    normals[i] = SIMDVec3(mesh->getRadiosityFace(i)->computeNormal());
+  }
+
+  // the visibility rays for one pair of patches
+  std::vector<RayData> rays;
+  std::vector<double> lengths;
+  std::vector<bool> occluded;
+  
   for(int i = 0; i < num_faces; ++i) {
     for(int j = 0; j < num_faces; ++j) {
       if(i == j) continue;
       Face* fi = mesh->getRadiosityFace(i);
       Face* fj = mesh->getRadiosityFace(j);
       int storageIndex = RAD_INDEX(i, j);
+      rays.clear();
+      lengths.clear();
+      GLOBAL_args->SeedRandom(RANDOM_STREAM_FORM_FACTOR, storageIndex);
       for(int k = 0; k < samples; ++k) {
         Vec3f pi = k == 0 ? fi->computeCentroid() : fi->RandomPoint();
         Vec3f pj = k == 0 ? fj->computeCentroid() : fj->RandomPoint();
@@ -122,24 +137,26 @@ void Radiosity::ComputeFormFactors() {
         dir.Normalize();
         
         //Sanity check
-        if(dir.Dot3(fi->computeNormal()) < 0.01) continue;
-        
-        Hit h;
-        Ray r(pi, dir);
+        if(Dot(SIMDVec3(dir), normals[i]) < 0.01) continue;
         
-        bool seesThing = raytracer->CastRay(r, h, true);
-        assert(seesThing);
+        rays.push_back({Ray(pi, dir), len - 0.01});
+        lengths.push_back(len);
+      }
+      
+      raytracer->Occluded(rays, occluded, true);
+      
+      for(unsigned int k = 0; k < rays.size(); ++k) {
+        if(occluded[k]) continue;
+        SIMDVec3 dir(rays[k].ray.getDirection());
+        double len = lengths[k];
+        double cosTi = Dot(dir, normals[i]);
+        double cosTj = -Dot(dir, normals[j]);
+        double df = cosTi * cosTj / (samples * M_PI * len * len + getArea(j)/samples);
         
-        if(h.getT() >= len - 0.01) {
-          double cosTi = dir.Dot3(fi->computeNormal());
-          double cosTj = dir.Dot3(-fj->computeNormal());
-          double df = cosTi * cosTj / (samples * M_PI * len * len + fj->getArea()/samples);
-          
-          formfactors[storageIndex] += MAX(df, 0);
-        }
+        formfactors[storageIndex] += MAX(df, 0);
       }
 
-      formfactors[storageIndex] *= fj->getArea();
+      formfactors[storageIndex] *= getArea(j);
     }
   }
   
@@ -0,0 +1,68 @@
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <stdint.h>
+
+// The different users of random numbers draw from separate streams,
+// so (for example) the pixels never share numbers with the photons.
+enum RANDOM_STREAM { RANDOM_STREAM_DEFAULT, RANDOM_STREAM_PIXEL,
+                     RANDOM_STREAM_PHOTON, RANDOM_STREAM_FORM_FACTOR,
+                     RANDOM_STREAM_CAUSTIC_PHOTON, RANDOM_STREAM_SPPM };
+
+// ====================================================================
+// ====================================================================
+// A small PCG32 generator (M. O'Neill, "PCG: A Family of Simple Fast
+// Space-Efficient Statistically Good Algorithms for Random Number
+// Generation", 2014).  The whole state is two 64 bit integers and
+// seeding is just two steps of the generator, so it is cheap to
+// restart it for every pixel (or photon) from the global seed and the
+// index of that pixel.  That way the random numbers used for a pixel
+// do not depend on which thread traced it, or on what was traced
+// before.
+
+class RandomGenerator {
+
+public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  // (constexpr so that a thread_local generator needs no guard)
+  constexpr RandomGenerator() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+
+  // =========
+  // MODIFIERS
+  void Seed(uint64_t seed, uint64_t stream) {
+    state = 0;
+    inc = (stream << 1) | 1;
+    Next();
+    state += seed;
+    Next();
+  }
+  void Seed(uint64_t seed, RANDOM_STREAM domain, uint64_t index) {
+    Seed(seed, (uint64_t(domain) << 56) ^ index);
+  }
+
+  // a random 32 bit integer
+  uint32_t Next() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+    uint32_t rot = uint32_t(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+  // a random real in [0,1)
+  double Uniform() {
+    return Next() * (1.0 / 4294967296.0);
+  }
+
+private:
+
+  // REPRESENTATION
+  uint64_t state;
+  uint64_t inc;
+};
+
+// ====================================================================
+// ====================================================================
+
+#endif
@@ -8,15 +8,29 @@
 #include "primitive.h"
 #include "photon_mapping.h"
 #include "boundingbox.h"
+#include "bvh.h"
+#include "scene_snapshot.h"
 #include "camera.h"
+#include "tile_renderer.h"
+#include "packet.h"
+#include "light_sampler.h"
 #include <math.h>
 #include <algorithm>
+#include <limits>
 #include <vector>
 
 static inline double randRange() {
   return 2 * GLOBAL_args->rand() - 1;
 }
 
+// a random order of the strata of the area lights (Fisher-Yates)
+static inline void shuffleStrata(std::vector<Vec2> &strata) {
+  for(int k = strata.size() - 1; k > 0; --k) {
+    int other = mymin(k, (int)(GLOBAL_args->rand() * (k + 1)));
+    std::swap(strata[k], strata[other]);
+  }
+}
+
 static inline void perturbVector(Vec3f& v, Material* m){
   while(true) {
     double dx = randRange();
@@ -31,9 +45,29 @@ static inline void perturbVector(Vec3f& v, Material* m){
   }
 }
 
+thread_local unsigned long long RayTracer::rays_cast = 0;
+std::atomic<unsigned long long> RayTracer::total_rays_cast(0);
+
+RayTracer::RayTracer(Mesh *m, ArgParser *a) {
+  mesh = m;
+  args = a;
+  render_to_a = true;
+  tile_renderer = new TileRenderer(this,a);
+  light_sampler = new LightSampler(m,a);
+  Init();
+}
+
+RayTracer::~RayTracer() {
+  delete tile_renderer;
+  delete light_sampler;
+}
+
+// the strata of the area lights: a grid with at least one cell per
+// shadow sample
 void RayTracer::Init() {
-  double s = sqrt(GLOBAL_args->mesh_data->num_shadow_samples);
+  double s = sqrt(mymax(1,args->mesh_data->num_shadow_samples));
   sampleDimension = (int)(ceil(s) + 0.5);
+  order.clear();
   order.reserve(sampleDimension * sampleDimension);
   for(int i = 0; i < sampleDimension * sampleDimension; ++i) {
     order.push_back({i % sampleDimension, i / sampleDimension});
@@ -43,19 +77,26 @@ void RayTracer::Init() {
 // ===========================================================================
 // casts a single ray through the scene geometry and finds the closest hit
 bool RayTracer::CastRay(const Ray &ray, Hit &h, bool use_rasterized_patches, int* portal_out) const {
+  rays_cast++;
+  if (args->mesh_data->use_bvh && mesh->getBVH() != NULL) {
+    return mesh->getBVH()->Intersect(ray,h,use_rasterized_patches,
+                                     args->mesh_data->intersect_backfacing,portal_out);
+  }
+
+  // otherwise, brute force
   bool answer = false;
+  const SceneSnapshot *snapshot = mesh->getSnapshot();
+  SnapshotRay sray(ray);
 
   // intersect each of the quads
-  for (int i = 0; i < mesh->numOriginalQuads(); i++) {
-    Face *f = mesh->getOriginalQuad(i);
-    if (f->intersect(ray,h,args->mesh_data->intersect_backfacing)) answer = true;
+  for (int i = 0; i < snapshot->numOriginalQuads(); i++) {
+    if (snapshot->IntersectQuad(i,sray,h,args->mesh_data->intersect_backfacing)) answer = true;
   }
 
   // intersect each of the primitives (either the patches, or the original primitives)
   if (use_rasterized_patches) {
-    for (int i = 0; i < mesh->numRasterizedPrimitiveFaces(); i++) {
-      Face *f = mesh->getRasterizedPrimitiveFace(i);
-      if (f->intersect(ray,h,args->mesh_data->intersect_backfacing)) answer = true;
+    for (int i = snapshot->numOriginalQuads(); i < snapshot->numQuads(); i++) {
+      if (snapshot->IntersectQuad(i,sray,h,args->mesh_data->intersect_backfacing)) answer = true;
     }
   } else {
     int num_primitives = mesh->numPrimitives();
@@ -82,15 +123,115 @@ bool RayTracer::CastRay(const Ray &ray, Hit &h, bool use_rasterized_patches, int
   return answer;
 }
 
+// ===========================================================================
+// any hit closer than tmax (no shading information needed)
+bool RayTracer::Occluded(const Ray &ray, float tmax, bool use_rasterized_patches, bool include_portals) const {
+  rays_cast++;
+  bool backfacing = args->mesh_data->intersect_backfacing;
+  if (args->mesh_data->use_bvh && mesh->getBVH() != NULL) {
+    return mesh->getBVH()->Occluded(ray,tmax,use_rasterized_patches,backfacing,include_portals);
+  }
+
+  // otherwise, brute force
+  const SceneSnapshot *snapshot = mesh->getSnapshot();
+  SnapshotRay sray(ray);
+  for (int i = 0; i < snapshot->numOriginalQuads(); i++) {
+    if (snapshot->OccludesQuad(i,sray,tmax,backfacing)) return true;
+  }
+  if (use_rasterized_patches) {
+    for (int i = snapshot->numOriginalQuads(); i < snapshot->numQuads(); i++) {
+      if (snapshot->OccludesQuad(i,sray,tmax,backfacing)) return true;
+    }
+  } else {
+    for (int i = 0; i < mesh->numPrimitives(); i++) {
+      if (mesh->getPrimitive(i)->occludes(ray,tmax)) return true;
+    }
+  }
+  if (include_portals) {
+    for (int i = 0; i < mesh->numPortalSides(); i++) {
+      if (mesh->getPortalSide(i).occludes(ray,tmax)) return true;
+    }
+  }
+  return false;
+}
+
+void RayTracer::Occluded(const std::vector<RayData> &rays, std::vector<bool> &occluded,
+                         bool use_rasterized_patches, bool include_portals) const {
+  occluded.resize(rays.size());
+  for (unsigned int i = 0; i < rays.size(); i++) {
+    occluded[i] = Occluded(rays[i].ray,rays[i].dist,use_rasterized_patches,include_portals);
+  }
+}
+
+// ===========================================================================
+// casts many rays, in SIMD packets of neighboring rays if possible
+void RayTracer::CastRays(const std::vector<Ray> &rays, std::vector<Hit> &hits,
+                         std::vector<bool> &answers, std::vector<int> &portals,
+                         bool use_rasterized_patches, bool find_portals) const {
+  int n = rays.size();
+  hits.assign(n,Hit());
+  answers.assign(n,false);
+  portals.assign(n,-1);
+
+  const BVH *bvh = mesh->getBVH();
+  bool packets = args->mesh_data->use_packets && args->mesh_data->use_bvh && bvh != NULL;
+  for (int start = 0; start < n; start += RAY_PACKET_SIZE) {
+    int count = std::min(RAY_PACKET_SIZE, n-start);
+    RayPacket packet;
+    const Ray *packet_rays[RAY_PACKET_SIZE];
+    for (int l = 0; l < count; l++) { packet_rays[l] = &rays[start+l]; }
+    if (packets && count > 1) {
+      packet.Set(packet_rays,count);
+    }
+    if (!packets || count == 1 || !packet.isCoherent()) {
+      // the rays diverge, trace them one at a time
+      for (int l = 0; l < count; l++) {
+        int i = start+l;
+        answers[i] = CastRay(rays[i],hits[i],use_rasterized_patches,find_portals ? &portals[i] : NULL);
+      }
+      continue;
+    }
+    rays_cast += count;
+    bool packet_answers[RAY_PACKET_SIZE];
+    bvh->IntersectPacket(packet,&hits[start],&portals[start],packet_answers,
+                         use_rasterized_patches,args->mesh_data->intersect_backfacing,find_portals);
+    for (int l = 0; l < count; l++) { answers[start+l] = packet_answers[l]; }
+  }
+}
+
+// ===========================================================================
+// Whether to continue a path, given the throughput it would continue
+// with: 0 ends the path, otherwise the radiance found along it is
+// scaled by the returned weight (and so is the throughput).  Paths that
+// can't contribute, or (optionally) whose contribution is below the
+// cutoff, end.  Below the roulette threshold a path survives with
+// probability throughput / threshold, and the survivors are weighted by
+// the inverse, so on average nothing is lost.
+double RayTracer::ContinuationWeight(Vec3f &throughput) const {
+  double t = mymax(throughput.r(), mymax(throughput.g(), throughput.b()));
+  if (t <= 0 || t < args->mesh_data->contribution_cutoff) return 0;
+  double threshold = args->mesh_data->russian_roulette_threshold;
+  if (t >= threshold) return 1;
+  double p = t / threshold;
+  if (args->rand() >= p) return 0;
+  throughput *= 1 / p;
+  return 1 / p;
+}
+
 // ===========================================================================
 // does the recursive (shadow rays & recursive rays) work
-Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max) const {
+Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max, const Vec3f &throughput) const {
 
   // First cast a ray and see if we hit anything.
   hit = Hit();
   int portalIndex = -1;
   
   bool intersect = CastRay(ray, hit, false, portal_max ? &portalIndex : NULL);
+  return ShadeRay(ray, hit, intersect, portalIndex, bounce_count, portal_max, throughput);
+}
+
+// the rest of TraceRay, once the closest hit (or portal) is known
+Vec3f RayTracer::ShadeRay(Ray &ray, Hit &hit, bool intersect, int portalIndex, int bounce_count, int portal_max, const Vec3f &throughput) const {
     
   // if there is no intersection, simply return the background color
   if (intersect == false) {
@@ -100,15 +241,19 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max)
   }
 
   if(portal_max > 0 && portalIndex >= 0) {
+    Vec3f tint = GLOBAL_args->mesh_data->portal_tint;
+    Vec3f next = throughput * tint;
+    double weight = ContinuationWeight(next);
+    if(weight == 0) return Vec3f(0,0,0);
     Vec3f orig = ray.pointAtParameter(hit.getT());
     Vec3f direction = ray.getDirection();
     mesh->getPortal(portalIndex / 2).getSide(portalIndex % 2).transferPoint(orig);
     mesh->getPortal(portalIndex / 2).getSide(portalIndex % 2).transferDirection(direction);
     Ray r(orig, direction);
     Hit newH;
-    Vec3f answer = TraceRay(r, newH, bounce_count, portal_max - 1);
+    Vec3f answer = TraceRay(r, newH, bounce_count, portal_max - 1, next);
     RayTree::AddTransmittedSegment(r, 0, newH.getT());
-    return GLOBAL_args->mesh_data->portal_tint * answer;
+    return weight * tint * answer;
   }
 
   // otherwise decide what to do based on the material
@@ -147,31 +292,64 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max)
 
   // ----------------------------------------------
   // add contributions from each light that is not in shadow
-  int num_lights = mesh->getLights().size();
-  for (int i = 0; i < num_lights; i++) {
+  enum LIGHT_SAMPLING light_sampling = args->mesh_data->light_sampling;
+  if (light_sampling != LIGHT_SAMPLING_ALL) {
+    // a fixed number of shadow rays, however many lights there are:
+    // each one goes to a light picked by the light sampler, and is
+    // divided by the probability of picking that light.  The strata
+    // are always shuffled, as the samples are spread over the lights.
+    int budget = mymax(1, args->mesh_data->num_shadow_samples);
+    std::vector<Vec2> strata(order);
+    if(budget > 1) shuffleStrata(strata);
+    std::vector<RayData> rays;
+    for(int j = 0; j < budget; ++j) {
+      double pdf;
+      int l = light_sampler->SampleLight(light_sampling, point, pdf);
+      if(l < 0) continue;  // no light reaches the point
+      Face *f = mesh->getLights()[l];
+      Vec3f lightColor = f->getMaterial()->getEmittedColor() * f->getArea();
+      rays.clear();
+      getRaystoLight(f, point, rays, budget > 1 ? &strata[j] : NULL);
+      for(unsigned int i = 0; i < rays.size(); ++i) {
+        Vec3f myLightColor = 1 / (budget * pdf * rays[i].dist * rays[i].dist) * lightColor;
+        answer += m->Shade(ray, hit, rays[i].ray.getDirection(), myLightColor, args);
+      }
+    }
+  } else {
+    int num_lights = mesh->getLights().size();
+    for (int i = 0; i < num_lights; i++) {
 
-    Face *f = mesh->getLights()[i];
-    Vec3f lightColor = f->getMaterial()->getEmittedColor() * f->getArea();
-    Vec3f myLightColor;
+      Face *f = mesh->getLights()[i];
+      Vec3f lightColor = f->getMaterial()->getEmittedColor() * f->getArea();
+      Vec3f myLightColor;
 
-    int shadowSamples = GLOBAL_args->mesh_data->num_shadow_samples;
-    std::vector<RayData> rays;
+      int shadowSamples = GLOBAL_args->mesh_data->num_shadow_samples;
+      std::vector<RayData> rays;
     
-    if(shadowSamples < 1) {
-      Vec3f lightCentroid = f->computeCentroid();
-      Vec3f dirToLightCentroid = lightCentroid-point;
-      float distToLightCentroid = dirToLightCentroid.Length();
-      dirToLightCentroid.Normalize();
-      myLightColor = 1 / float (distToLightCentroid*distToLightCentroid) * lightColor;
-      answer += m->Shade(ray, hit, dirToLightCentroid, myLightColor, args);
-    } else {
-      for(int j = 0; j < shadowSamples; ++j) {
-        rays.clear();
-        getRaystoLight(f, point, rays, j != 0);
+      if(shadowSamples < 1) {
+        Vec3f lightCentroid = f->computeCentroid();
+        Vec3f dirToLightCentroid = lightCentroid-point;
+        float distToLightCentroid = dirToLightCentroid.Length();
+        dirToLightCentroid.Normalize();
+        myLightColor = 1 / float (distToLightCentroid*distToLightCentroid) * lightColor;
+        answer += m->Shade(ray, hit, dirToLightCentroid, myLightColor, args);
+      } else {
+        // a single sample goes to the center of the light, otherwise
+        // each sample is placed in its own stratum of the light.  When
+        // there are more strata than samples, shuffling picks a
+        // different subset of the strata at every point.
+        std::vector<Vec2> strata(order);
+        if(shadowSamples > 1 && args->mesh_data->shuffle_light_strata) {
+          shuffleStrata(strata);
+        }
+        for(int j = 0; j < shadowSamples; ++j) {
+          rays.clear();
+          getRaystoLight(f, point, rays, shadowSamples > 1 ? &strata[j] : NULL);
         
-        for(int i = 0; i < rays.size(); ++i) {
-          myLightColor = 1 / (shadowSamples * rays[i].dist * rays[i].dist) * lightColor;
-          answer += m->Shade(ray, hit, rays[i].ray.getDirection(), myLightColor, args);
+          for(int i = 0; i < rays.size(); ++i) {
+            myLightColor = 1 / (shadowSamples * rays[i].dist * rays[i].dist) * lightColor;
+            answer += m->Shade(ray, hit, rays[i].ray.getDirection(), myLightColor, args);
+          }
         }
       }
     }
@@ -182,7 +360,9 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max)
   Vec3f reflectiveColor = m->getReflectiveColor();
 
 
-  if(bounce_count > 0)
+  Vec3f next = throughput * reflectiveColor;
+  double weight = (bounce_count > 0) ? ContinuationWeight(next) : 0;
+  if(weight > 0)
   {
     Vec3f ri = ray.getDirection();
     Vec3f rr = ri - 2 * ri.Dot3(normal) * normal;
@@ -190,7 +370,7 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max)
     if(GLOBAL_args->gloss) perturbVector(rr, m);
     Ray r(point, rr);
     Hit newH;
-    Vec3f reflected = reflectiveColor * TraceRay(r, newH, bounce_count - 1, GLOBAL_args->mesh_data->portal_recursion_depth);
+    Vec3f reflected = weight * reflectiveColor * TraceRay(r, newH, bounce_count - 1, GLOBAL_args->mesh_data->portal_recursion_depth, next);
     RayTree::AddReflectedSegment(r, 0, newH.getT());
     answer += reflected;
   }
@@ -206,39 +386,47 @@ Vec3f RayTracer::TraceRay(Ray &ray, Hit &hit, int bounce_count, int portal_max)
 
 
 
+// the rays through pixel (i,j) of the image: first through the center
+// of the pixel, then the randomly jittered antialiasing samples
+void GeneratePixelRays(double i, double j, std::vector<Ray> &rays) {
+  int multiSampleCount = GLOBAL_args->mesh_data->num_antialias_samples;
+  if(multiSampleCount < 1) multiSampleCount = 1;
+  GeneratePixelRays(i,j,0,multiSampleCount,rays);
+}
+
+// samples [first,first+count) of pixel (i,j), sample 0 is the center
+void GeneratePixelRays(double i, double j, int first, int count, std::vector<Ray> &rays) {
+  int max_d = mymax(GLOBAL_args->mesh_data->width,GLOBAL_args->mesh_data->height);
+  rays.clear();
+
+  for(int k = first; k < first + count; ++k)
+  {
+    double px = 0;
+    double py = 0;
+    if(k > 0) {
+      px = (GLOBAL_args->rand() - 0.5) / GLOBAL_args->mesh_data->width;
+      py = (GLOBAL_args->rand() - 0.5) / GLOBAL_args->mesh_data->height;
+    }
+    double x = (i-GLOBAL_args->mesh_data->width/2.0)/double(max_d) + 0.5 + px;
+    double y = (j-GLOBAL_args->mesh_data->height/2.0)/double(max_d) + 0.5 + py;
+    rays.push_back(GLOBAL_args->mesh->camera->generateRay(x,y));
+  }
+}
+
 // trace a ray through pixel (i,j) of the image an return the color
 Vec3f VisualizeTraceRay(double i, double j) {
-  
+  std::vector<Ray> rays;
+  GeneratePixelRays(i,j,rays);
 
   // compute and set the pixel color
-  int max_d = mymax(GLOBAL_args->mesh_data->width,GLOBAL_args->mesh_data->height);
   Vec3f color;
-  
-
-  // Here's what we do with a single sample per pixel:
-  // construct & trace a ray through the center of the pixle
-  double x = (i-GLOBAL_args->mesh_data->width/2.0)/double(max_d)+0.5;
-  double y = (j-GLOBAL_args->mesh_data->height/2.0)/double(max_d)+0.5;
-  Ray r = GLOBAL_args->mesh->camera->generateRay(x,y); 
-  Hit hit;
-  color = GLOBAL_args->raytracer->TraceRay(r,hit,GLOBAL_args->mesh_data->num_bounces, GLOBAL_args->mesh_data->portal_recursion_depth);
-  // add that ray for visualization
-  RayTree::AddMainSegment(r,0,hit.getT());
-  int multiSampleCount = GLOBAL_args->mesh_data->num_antialias_samples;
-  if(multiSampleCount < 1) multiSampleCount = 1;
-  
-  for(int k = 1; k < multiSampleCount; ++k)
-  {
-    double px = (GLOBAL_args->rand() - 0.5) / GLOBAL_args->mesh_data->width;
-    double py = (GLOBAL_args->rand() - 0.5) / GLOBAL_args->mesh_data->height;
-    x = (i-GLOBAL_args->mesh_data->width/2.0)/double(max_d) + 0.5 + px;
-    y = (j-GLOBAL_args->mesh_data->height/2.0)/double(max_d) + 0.5 + py;
-    r = GLOBAL_args->mesh->camera->generateRay(x,y);
-    color += GLOBAL_args->raytracer->TraceRay(r,hit,GLOBAL_args->mesh_data->num_bounces, GLOBAL_args->mesh_data->portal_recursion_depth);
-    RayTree::AddMainSegment(r,0,hit.getT());
+  for (unsigned int k = 0; k < rays.size(); k++) {
+    Hit hit;
+    color += GLOBAL_args->raytracer->TraceRay(rays[k],hit,GLOBAL_args->mesh_data->num_bounces, GLOBAL_args->mesh_data->portal_recursion_depth);
+    // add that ray for visualization
+    RayTree::AddMainSegment(rays[k],0,hit.getT());
   }
-  
-  color *= 1.0 / multiSampleCount;
+  color *= 1.0 / rays.size();
 
   // return the color
   return color;
@@ -265,73 +453,14 @@ Vec3f PixelGetPos(double i, double j) {
 
 
 
-// Scan through the image from the lower left corner across each row
-// and then up to the top right.  Initially the image is sampled very
-// coarsely.  Increment the static variables that track the progress
-// through the scans
-int RayTraceDrawPixel() {
-  if (GLOBAL_args->mesh_data->raytracing_x >= GLOBAL_args->mesh_data->raytracing_divs_x) {
-    // end of row
-    GLOBAL_args->mesh_data->raytracing_x = 0; 
-    GLOBAL_args->mesh_data->raytracing_y += 1;
-  }
-  if (GLOBAL_args->mesh_data->raytracing_y >= GLOBAL_args->mesh_data->raytracing_divs_y) {
-    // last row
-    if (GLOBAL_args->mesh_data->raytracing_divs_x >= GLOBAL_args->mesh_data->width ||
-        GLOBAL_args->mesh_data->raytracing_divs_y >= GLOBAL_args->mesh_data->height) {
-      // stop rendering, matches resolution of current camera
-      return 0; 
-    }
-    // else decrease pixel size & start over again in the bottom left corner
-    GLOBAL_args->mesh_data->raytracing_divs_x *= 3;
-    GLOBAL_args->mesh_data->raytracing_divs_y *= 3;
-    if (GLOBAL_args->mesh_data->raytracing_divs_x > GLOBAL_args->mesh_data->width * 0.51 ||
-        GLOBAL_args->mesh_data->raytracing_divs_x > GLOBAL_args->mesh_data->height * 0.51) {
-      GLOBAL_args->mesh_data->raytracing_divs_x = GLOBAL_args->mesh_data->width;
-      GLOBAL_args->mesh_data->raytracing_divs_y = GLOBAL_args->mesh_data->height;
-    }
-    GLOBAL_args->mesh_data->raytracing_x = 0;
-    GLOBAL_args->mesh_data->raytracing_y = 0;
-
-    if (GLOBAL_args->raytracer->render_to_a) {
-      GLOBAL_args->raytracer->pixels_b.clear();
-      GLOBAL_args->raytracer->render_to_a = false;
-    } else {
-      GLOBAL_args->raytracer->pixels_a.clear();
-      GLOBAL_args->raytracer->render_to_a = true;
-    }
-  }
-
-  double x_spacing = GLOBAL_args->mesh_data->width / double (GLOBAL_args->mesh_data->raytracing_divs_x);
-  double y_spacing = GLOBAL_args->mesh_data->height / double (GLOBAL_args->mesh_data->raytracing_divs_y);
-
-  // compute the color and position of intersection
-  Vec3f pos1 =  PixelGetPos((GLOBAL_args->mesh_data->raytracing_x  )*x_spacing, (GLOBAL_args->mesh_data->raytracing_y  )*y_spacing);
-  Vec3f pos2 =  PixelGetPos((GLOBAL_args->mesh_data->raytracing_x+1)*x_spacing, (GLOBAL_args->mesh_data->raytracing_y  )*y_spacing);
-  Vec3f pos3 =  PixelGetPos((GLOBAL_args->mesh_data->raytracing_x+1)*x_spacing, (GLOBAL_args->mesh_data->raytracing_y+1)*y_spacing);
-  Vec3f pos4 =  PixelGetPos((GLOBAL_args->mesh_data->raytracing_x  )*x_spacing, (GLOBAL_args->mesh_data->raytracing_y+1)*y_spacing);
-
-  Vec3f color = VisualizeTraceRay((GLOBAL_args->mesh_data->raytracing_x+0.5)*x_spacing, (GLOBAL_args->mesh_data->raytracing_y+0.5)*y_spacing);
-
-  double r = linear_to_srgb(color.r());
-  double g = linear_to_srgb(color.g());
-  double b = linear_to_srgb(color.b());
-
-  Pixel p;
-  p.v1 = pos1;
-  p.v2 = pos2;
-  p.v3 = pos3;
-  p.v4 = pos4;
-  p.color = Vec3f(r,g,b);
-    
-  if (GLOBAL_args->raytracer->render_to_a) {
-    GLOBAL_args->raytracer->pixels_a.push_back(p);
-  } else {
-    GLOBAL_args->raytracer->pixels_b.push_back(p);
-  }  
-
-  GLOBAL_args->mesh_data->raytracing_x += 1;
-  return 1;
+// Render the next batch of tiles of the progressive image (see
+// TileRenderer).  Initially the image is sampled very coarsely, each
+// following pass is 3x finer until the resolution of the camera is
+// reached, then passes add samples to every pixel.  Returns 0 when
+// the image is complete.
+int RayTraceDrawTiles() {
+  TileRenderer *tiles = GLOBAL_args->raytracer->getTileRenderer();
+  return tiles->RenderTiles(RAYTRACE_PIXELS_PER_THREAD * GLOBAL_args->numThreads());
 }
 
 // ===========================================================================
@@ -379,23 +508,30 @@ void RayTracer::packMesh(float* &current) {
   }
 }
 
-bool RayTracer::getRaystoLight(const Face* light, const Vec3f& point, std::vector<RayData>& outRays, bool use_random_point) const {
+// the rays from point to a sample on the light (the centroid, or a
+// random point within the given stratum), directly & through each
+// portal.  The portal rays aim at the transferred image of the same
+// sample, so they are stratified too.
+bool RayTracer::getRaystoLight(const Face* light, const Vec3f& point, std::vector<RayData>& outRays, const Vec2 *stratum) const {
   unsigned int startSize = outRays.size();
   
   int portal = -1;
   
   //Test for direct ray
-  Vec3f lightCentroid = use_random_point ? light->RandomPoint() : light->computeCentroid();
+  Vec3f lightCentroid = stratum != NULL ?
+    light->RandomPoint(stratum->x, stratum->y, sampleDimension) : light->computeCentroid();
   Vec3f dirToLightCentroid = lightCentroid-point;
   double lightDist = dirToLightCentroid.Length();
   dirToLightCentroid.Normalize();
-  Hit h;
   Ray r(point, dirToLightCentroid);
-  bool res = CastRay(r, h, false, &portal);
-  if(res && portal < 0 && h.getT() >= lightDist - 0.01) {
+  // visible if nothing is in the way and something (the light, or
+  // whatever is behind it if the light faces away) is hit at or beyond
+  // the sample, as the first hit of a CastRay would be
+  const float beyond = std::numeric_limits<float>::max();
+  if(!Occluded(r, lightDist - 0.01, false, true) && Occluded(r, beyond)) {
     outRays.push_back({r, lightDist});
   }
-  RayTree::AddShadowSegment(r, 0, h.getT());
+  RayTree::AddShadowSegment(r, 0, lightDist);
   
   for(unsigned int i = 0; i < mesh->numPortals() * 2; ++i) {
     //Test to see if light in portal FOV
@@ -409,19 +545,17 @@ bool RayTracer::getRaystoLight(const Face* light, const Vec3f& point, std::vecto
     bool res = CastRay(p, portalH, false, &portal);
     if(res && portal == i) {
       //Test to see light
-      Hit throughH;
       Vec3f recast = p.pointAtParameter(portalH.getT());
       Vec3f reDir = dirToLightCentroid;
       mesh->getPortal(i / 2).getSide(i % 2).transferPoint(recast);
       mesh->getPortal(i / 2).getSide(i % 2).transferDirection(reDir);
       double reDist = (lightCentroid - recast).Length();
       Ray throughRay(recast, reDir);
-      res = CastRay(throughRay, throughH, false);
-      if(res && throughH.getT() >= reDist - 0.01) {
+      if(!Occluded(throughRay, reDist - 0.01) && Occluded(throughRay, beyond)) {
         outRays.push_back({p, lightDist + reDist});
       }
       RayTree::AddShadowSegment(p, 0, portalH.getT());
-      RayTree::AddShadowSegment(throughRay, 0, throughH.getT());
+      RayTree::AddShadowSegment(throughRay, 0, reDist);
     }
   }
   
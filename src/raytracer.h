@@ -2,6 +2,7 @@
 #define _RAY_TRACER_
 
 #include <vector>
+#include <atomic>
 #include "ray.h"
 #include "hit.h"
 #include "meshdata.h"
@@ -11,6 +12,8 @@ class ArgParser;
 class Radiosity;
 class PhotonMapping;
 class Face;
+class TileRenderer;
+class LightSampler;
 
 // ====================================================================
 // ====================================================================
@@ -38,11 +41,8 @@ class RayTracer {
 public:
 
   // CONSTRUCTOR & DESTRUCTOR
-  RayTracer(Mesh *m, ArgParser *a) {
-    mesh = m;
-    args = a;
-    render_to_a = true;
-  }  
+  RayTracer(Mesh *m, ArgParser *a);
+  ~RayTracer();
   // set access to the other modules for hybrid rendering options
   void setRadiosity(Radiosity *r) { radiosity = r; }
   void setPhotonMapping(PhotonMapping *pm) { photon_mapping = pm; }
@@ -50,13 +50,44 @@ public:
   // casts a single ray through the scene geometry and finds the closest hit
   bool CastRay(const Ray &ray, Hit &h, bool use_sphere_patches, int* portal_out = NULL) const;
 
-  // does the recursive work
-  Vec3f TraceRay(Ray &ray, Hit &hit, int bounce_count = 0, int portal_max = 0) const;
+  // shadow & visibility rays: is anything hit closer than tmax?  Stops
+  // at the first blocker and never looks up normals, materials or
+  // texture coordinates
+  bool Occluded(const Ray &ray, float tmax, bool use_sphere_patches = false, bool include_portals = false) const;
+  // the same query for many rays at once (tmax is each RayData's dist)
+  void Occluded(const std::vector<RayData> &rays, std::vector<bool> &occluded,
+                bool use_sphere_patches = false, bool include_portals = false) const;
+
+  // casts many (coherent, e.g., primary) rays at once, in SIMD packets
+  // where possible.  Same results as CastRay for each ray, portals[i]
+  // is -1 unless find_portals is set and ray i hit a portal.
+  void CastRays(const std::vector<Ray> &rays, std::vector<Hit> &hits,
+                std::vector<bool> &answers, std::vector<int> &portals,
+                bool use_sphere_patches, bool find_portals) const;
+
+  // does the recursive work.  throughput is the product of the
+  // reflective colors & portal tints the result will be scaled by
+  Vec3f TraceRay(Ray &ray, Hit &hit, int bounce_count = 0, int portal_max = 0,
+                 const Vec3f &throughput = Vec3f(1,1,1)) const;
+  // the same, for a ray whose first hit was already cast
+  Vec3f ShadeRay(Ray &ray, Hit &hit, bool intersect, int portalIndex, int bounce_count = 0, int portal_max = 0,
+                 const Vec3f &throughput = Vec3f(1,1,1)) const;
   
   void Init();
 
+  // the progressive (multi-threaded) renderer of the image
+  TileRenderer* getTileRenderer() const { return tile_renderer; }
+
+  // statistics: every CastRay & Occluded query counts as one ray.
+  // Each thread counts on its own, call FlushRayCount (from that
+  // thread) to add its rays to the total.
+  static void FlushRayCount() { total_rays_cast += rays_cast; rays_cast = 0; }
+  static unsigned long long numRaysCast() { FlushRayCount(); return total_rays_cast; }
+  static void ResetRayCount() { rays_cast = 0; total_rays_cast = 0; }
+
 private:
-  bool getRaystoLight(const Face* light, const Vec3f& point, std::vector<RayData>& outRays, bool use_random_point = false) const;
+  double ContinuationWeight(Vec3f &throughput) const;
+  bool getRaystoLight(const Face* light, const Vec3f& point, std::vector<RayData>& outRays, const Vec2 *stratum = NULL) const;
   void drawVBOs_a();
   void drawVBOs_b();
 
@@ -65,10 +96,15 @@ private:
   ArgParser *args;
   Radiosity *radiosity;
   PhotonMapping *photon_mapping;
+  TileRenderer *tile_renderer;
+  LightSampler *light_sampler;
   
   int sampleDimension;
   mutable std::vector<Vec2> order;
 
+  static thread_local unsigned long long rays_cast;
+  static std::atomic<unsigned long long> total_rays_cast;
+
 public:
   bool render_to_a;
 
@@ -82,9 +118,12 @@ public:
 // ====================================================================
 // ====================================================================
 
-int RayTraceDrawPixel();
+int RayTraceDrawTiles();
 
 Vec3f VisualizeTraceRay(double i, double j);
+void GeneratePixelRays(double i, double j, std::vector<Ray> &rays);
+void GeneratePixelRays(double i, double j, int first, int count, std::vector<Ray> &rays);
+Vec3f PixelGetPos(double i, double j);
 
 
 #endif
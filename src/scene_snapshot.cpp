@@ -0,0 +1,165 @@
+#include <cmath>
+#include <cstdint>
+
+#include "scene_snapshot.h"
+#include "mesh.h"
+#include "face.h"
+#include "vertex.h"
+#include "ray.h"
+#include "hit.h"
+#include "utils.h"
+
+static_assert(sizeof(SnapshotQuad) == SNAPSHOT_ALIGNMENT, "a quad should fill one cache line");
+
+// ==================================================================
+// HELPER FUNCTIONS
+
+static inline size_t RoundUpToAlignment(size_t bytes) {
+  return (bytes + SNAPSHOT_ALIGNMENT - 1) & ~size_t(SNAPSHOT_ALIGNMENT - 1);
+}
+
+// The barycentric coordinates of the point where the ray crosses the
+// triangle (v0, v0+ea, v0+eb), s is the ray origin minus v0.  Solved
+// with Moller-Trumbore (the same system, and the same tolerances, as
+// the Cramer's rule solution in Face::triangle_intersect).
+static inline bool TriangleBarycentrics(const SIMDVec3 &s, const SIMDVec3 &dir,
+                                        const SIMDVec3 &ea, const SIMDVec3 &eb,
+                                        float &beta, float &gamma) {
+  SIMDVec3 p = Cross(dir,eb);
+  float det = Dot(ea,p);
+  if (fabs(det) <= 0.000001) return false;
+  float inv = 1.0f / det;
+  beta = Dot(s,p) * inv;
+  if (beta < -0.00001 || beta > 1.00001) return false;
+  gamma = Dot(dir,Cross(s,ea)) * inv;
+  return (gamma >= -0.00001 && gamma <= 1.00001 && beta + gamma <= 1.00001);
+}
+
+// The distance to the plane of the quad if the ray hits the quad
+// within (EPSILON,tmax), otherwise -1.  tri is set to the triangle
+// (0: v0,v1,v2  1: v0,v2,v3) that was hit.
+static inline float QuadDistance(const SnapshotQuad &q, const SnapshotRay &r, float tmax,
+                                 bool intersect_backfacing, int &tri, float &beta, float &gamma) {
+  SIMDVec3 n = SIMDVec3::Load(q.n);
+  float denom = Dot(r.d,n);
+  if (denom == 0) return -1;  // parallel to plane
+  if (!intersect_backfacing && denom >= 0) return -1;  // hit the backside
+  float t = (q.d - Dot(r.o,n)) / denom;
+  if (!(t > EPSILON && t < tmax)) return -1;
+  SIMDVec3 s = r.o - SIMDVec3::Load(q.v0);
+  SIMDVec3 e2 = SIMDVec3::Load(q.e2);
+  if (TriangleBarycentrics(s,r.d,SIMDVec3::Load(q.e1),e2,beta,gamma)) { tri = 0; return t; }
+  if (TriangleBarycentrics(s,r.d,e2,SIMDVec3::Load(q.e3),beta,gamma)) { tri = 1; return t; }
+  return -1;
+}
+
+SnapshotRay::SnapshotRay(const Ray &r) : o(r.getOrigin()), d(r.getDirection()) {}
+
+// ==================================================================
+// CONSTRUCTION
+
+SceneSnapshot::SceneSnapshot() {
+  storage = NULL;
+  quads = NULL;
+  shading = NULL;
+  num_quads = 0;
+  num_original_quads = 0;
+}
+
+SceneSnapshot::~SceneSnapshot() {
+  delete [] storage;
+}
+
+void SceneSnapshot::Build(const Mesh *mesh) {
+  delete [] storage;
+  materials = mesh->materials;
+  num_original_quads = mesh->numOriginalQuads();
+  num_quads = num_original_quads + mesh->numRasterizedPrimitiveFaces();
+
+  // one allocation, the quads first, then the shading records
+  size_t quad_bytes = RoundUpToAlignment(num_quads * sizeof(SnapshotQuad));
+  size_t shading_bytes = RoundUpToAlignment(num_quads * sizeof(SnapshotShading));
+  storage = new char[quad_bytes + shading_bytes + SNAPSHOT_ALIGNMENT];
+  uintptr_t base = RoundUpToAlignment(uintptr_t(storage));
+  quads = reinterpret_cast<SnapshotQuad*>(base);
+  shading = reinterpret_cast<SnapshotShading*>(base + quad_bytes);
+
+  for (int i = 0; i < num_original_quads; i++) {
+    AddQuad(mesh->getOriginalQuad(i),i);
+  }
+  for (int i = 0; i < mesh->numRasterizedPrimitiveFaces(); i++) {
+    AddQuad(mesh->getRasterizedPrimitiveFace(i),RasterizedFaceIndex(i));
+  }
+}
+
+void SceneSnapshot::AddQuad(const Face *f, int i) {
+  // the differences & the normal are computed in double precision
+  // before rounding
+  Vec3f v[4];
+  for (int j = 0; j < 4; j++) { v[j] = (*f)[j]->get(); }
+  Vec3f normal = f->computeNormal();
+  SnapshotQuad &q = quads[i];
+  for (int a = 0; a < 3; a++) {
+    q.v0[a] = v[0][a];
+    q.e1[a] = v[1][a] - v[0][a];
+    q.e2[a] = v[2][a] - v[0][a];
+    q.e3[a] = v[3][a] - v[0][a];
+    q.n[a] = normal[a];
+  }
+  q.d = normal.Dot3(v[0]);
+
+  SnapshotShading &sh = shading[i];
+  for (int j = 0; j < 4; j++) {
+    sh.s[j] = (*f)[j]->get_s();
+    sh.t[j] = (*f)[j]->get_t();
+  }
+  sh.material = MaterialIndex(f->getMaterial());
+}
+
+int SceneSnapshot::MaterialIndex(Material *m) {
+  for (unsigned int i = 0; i < materials.size(); i++) {
+    if (materials[i] == m) return i;
+  }
+  materials.push_back(m);
+  return materials.size()-1;
+}
+
+void SceneSnapshot::getCorner(int i, int corner, double p[3]) const {
+  assert (corner >= 0 && corner < 4);
+  const SnapshotQuad &q = getQuad(i);
+  const float *e = (corner == 1) ? q.e1 : ((corner == 2) ? q.e2 : q.e3);
+  for (int a = 0; a < 3; a++) {
+    p[a] = q.v0[a];
+    if (corner > 0) p[a] += e[a];
+  }
+}
+
+// ==================================================================
+// RAYTRACING
+
+bool SceneSnapshot::IntersectQuad(int i, const SnapshotRay &r, Hit &h, bool intersect_backfacing) const {
+  const SnapshotQuad &q = getQuad(i);
+  int tri;
+  float beta, gamma;
+  float t = QuadDistance(q,r,h.getT(),intersect_backfacing,tri,beta,gamma);
+  if (t < 0) return false;
+
+  const SnapshotShading &sh = shading[i];
+  h.set(t,materials[sh.material],Vec3f(q.n[0],q.n[1],q.n[2]));
+  // interpolate the texture coordinates of the triangle's corners
+  int b = tri+1;
+  int c = tri+2;
+  float alpha = 1 - beta - gamma;
+  h.setTextureCoords(alpha * sh.s[0] + beta * sh.s[b] + gamma * sh.s[c],
+                     alpha * sh.t[0] + beta * sh.t[b] + gamma * sh.t[c]);
+  assert (h.getT() >= EPSILON);
+  return true;
+}
+
+bool SceneSnapshot::OccludesQuad(int i, const SnapshotRay &r, float tmax, bool intersect_backfacing) const {
+  int tri;
+  float beta, gamma;
+  return QuadDistance(getQuad(i),r,tmax,intersect_backfacing,tri,beta,gamma) >= 0;
+}
+
+// ==================================================================
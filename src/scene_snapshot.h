@@ -0,0 +1,111 @@
+#ifndef _SCENE_SNAPSHOT_H_
+#define _SCENE_SNAPSHOT_H_
+
+#include <cassert>
+#include <vector>
+#include "simd_math.h"
+
+class Mesh;
+class Face;
+class Material;
+class Ray;
+class Hit;
+
+// the arrays of the snapshot start on a cache line
+#define SNAPSHOT_ALIGNMENT 64
+
+// ==================================================================
+// The geometry of one quad, exactly one cache line.  The quad is
+// split into the triangles (v0,v1,v2) & (v0,v2,v3), stored as the
+// first corner and the edges from it to the other three corners.
+
+struct SnapshotQuad {
+  float v0[3];
+  float e1[3];   // v1-v0
+  float e2[3];   // v2-v0
+  float e3[3];   // v3-v0
+  float n[3];    // the average of the two triangle normals (not normalized)
+  float d;       // the plane offset n.v0
+};
+
+// What is needed once the closest quad is known (kept out of the
+// intersection loop, so the tests only touch SnapshotQuads).
+struct SnapshotShading {
+  float s[4];    // the texture coordinates of the 4 corners
+  float t[4];
+  int material;  // index into the material table of the snapshot
+};
+
+// The ray converted to single precision once, before it is tested
+// against any number of quads.
+struct SnapshotRay {
+  SnapshotRay() {}
+  SnapshotRay(const Ray &r);
+  SIMDVec3 o;
+  SIMDVec3 d;
+};
+
+// ==================================================================
+// A flat, read only, single precision copy of the ray traceable quads
+// of the mesh (the original quads, followed by the rasterized
+// primitive faces), compiled once the mesh is loaded.  The ray tracer
+// (and the BVH) intersect these arrays rather than walking the half
+// edge structure & recomputing the face normals for every test.  The
+// editable mesh is left alone, so radiosity can keep subdividing it.
+
+class SceneSnapshot {
+
+ public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  SceneSnapshot();
+  ~SceneSnapshot();
+  void Build(const Mesh *mesh);
+
+  // =========
+  // ACCESSORS
+  int numQuads() const { return num_quads; }
+  int numOriginalQuads() const { return num_original_quads; }
+  // the rasterized primitive faces follow the original quads
+  int RasterizedFaceIndex(int i) const { return num_original_quads + i; }
+  const SnapshotQuad& getQuad(int i) const {
+    assert (i >= 0 && i < num_quads);
+    return quads[i]; }
+  const SnapshotShading& getShading(int i) const {
+    assert (i >= 0 && i < num_quads);
+    return shading[i]; }
+  Material* getMaterial(int i) const {
+    assert (i >= 0 && i < (int)materials.size());
+    return materials[i]; }
+  // the corner (0-3) of a quad, in double precision
+  void getCorner(int i, int corner, double p[3]) const;
+
+  // ==========
+  // RAYTRACING
+  // same semantics as Face::intersect & Face::occludes
+  bool IntersectQuad(int i, const SnapshotRay &r, Hit &h, bool intersect_backfacing) const;
+  bool OccludesQuad(int i, const SnapshotRay &r, float tmax, bool intersect_backfacing) const;
+
+ private:
+
+  // don't copy the arrays
+  SceneSnapshot(const SceneSnapshot&);
+  SceneSnapshot& operator=(const SceneSnapshot&);
+
+  // HELPER FUNCTIONS
+  void AddQuad(const Face *f, int i);
+  int MaterialIndex(Material *m);
+
+  // REPRESENTATION
+  char *storage;             // the allocation both arrays are carved from
+  SnapshotQuad *quads;       // SNAPSHOT_ALIGNMENT aligned
+  SnapshotShading *shading;  // SNAPSHOT_ALIGNMENT aligned
+  int num_quads;
+  int num_original_quads;
+  std::vector<Material*> materials;
+};
+
+// ==================================================================
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef _SIMD_MATH_H_
+#define _SIMD_MATH_H_
+
+#include <cmath>
+#include "vectors.h"
+#include "matrix.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#else
+#define SIMD_MATH_SCALAR
+#endif
+
+// ====================================================================
+// ====================================================================
+// Single precision 3 component vector, stored as 4 floats (the last
+// one is kept at 0) in one 16 byte aligned SSE register.  A float
+// counterpart of Vec3f for the hot loops of the ray tracer, photon
+// mapper & radiosity: half the memory traffic, and twice the SIMD
+// width, of the double Vec3f.
+//
+// The horizontal sums add x, y & z left to right (like the scalar
+// code would), so the results don't depend on which implementation
+// is compiled in.  (Under AVX the same code is VEX encoded, 8 wide
+// work on many vectors at once is done with the PacketFloat of
+// packet.h.)
+
+class SIMDVec3 {
+
+public:
+
+  // -----------------------------------------------
+  // CONSTRUCTORS, ASSIGNMENT OPERATOR, & DESTRUCTOR
+  SIMDVec3() { set(0,0,0); }
+  SIMDVec3(float x, float y, float z) { set(x,y,z); }
+  explicit SIMDVec3(const Vec3f &v) { set(v.x(),v.y(),v.z()); }
+  // reads exactly 3 floats (p need not be aligned)
+  static SIMDVec3 Load(const float p[3]) { return SIMDVec3(p[0],p[1],p[2]); }
+
+  // ----------------------------
+  // SIMPLE ACCESSORS & MODIFIERS
+  float x() const {
+#ifndef SIMD_MATH_SCALAR
+    return _mm_cvtss_f32(v);
+#else
+    return v[0];
+#endif
+  }
+  float y() const {
+#ifndef SIMD_MATH_SCALAR
+    return _mm_cvtss_f32(_mm_shuffle_ps(v,v,_MM_SHUFFLE(1,1,1,1)));
+#else
+    return v[1];
+#endif
+  }
+  float z() const {
+#ifndef SIMD_MATH_SCALAR
+    return _mm_cvtss_f32(_mm_shuffle_ps(v,v,_MM_SHUFFLE(2,2,2,2)));
+#else
+    return v[2];
+#endif
+  }
+  float operator[](int i) const {
+    assert (i >= 0 && i < 3);
+    return i == 0 ? x() : (i == 1 ? y() : z()); }
+  void set(float x, float y, float z) {
+#ifndef SIMD_MATH_SCALAR
+    v = _mm_set_ps(0,z,y,x);
+#else
+    v[0] = x; v[1] = y; v[2] = z; v[3] = 0;
+#endif
+  }
+  Vec3f toVec3f() const { return Vec3f(x(),y(),z()); }
+  void Store(float p[3]) const { p[0] = x(); p[1] = y(); p[2] = z(); }
+
+  // ------------------------
+  // COMMON VECTOR OPERATIONS
+  float LengthSq() const { return Dot(*this,*this); }
+  float Length() const { return sqrtf(LengthSq()); }
+  void Normalize() {
+    float length = Length();
+    if (length > 0) { *this = *this * (1 / length); } }
+  friend float Dot(const SIMDVec3 &a, const SIMDVec3 &b) {
+#ifndef SIMD_MATH_SCALAR
+    __m128 m = _mm_mul_ps(a.v,b.v);
+    __m128 y = _mm_shuffle_ps(m,m,_MM_SHUFFLE(1,1,1,1));
+    __m128 z = _mm_shuffle_ps(m,m,_MM_SHUFFLE(2,2,2,2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m,y),z));
+#else
+    return a.v[0]*b.v[0] + a.v[1]*b.v[1] + a.v[2]*b.v[2];
+#endif
+  }
+  friend SIMDVec3 Cross(const SIMDVec3 &a, const SIMDVec3 &b) {
+    SIMDVec3 c;
+#ifndef SIMD_MATH_SCALAR
+    // (a.y b.z - a.z b.y, a.z b.x - a.x b.z, a.x b.y - a.y b.x)
+    __m128 a_yzx = _mm_shuffle_ps(a.v,a.v,_MM_SHUFFLE(3,0,2,1));
+    __m128 b_yzx = _mm_shuffle_ps(b.v,b.v,_MM_SHUFFLE(3,0,2,1));
+    __m128 a_zxy = _mm_shuffle_ps(a.v,a.v,_MM_SHUFFLE(3,1,0,2));
+    __m128 b_zxy = _mm_shuffle_ps(b.v,b.v,_MM_SHUFFLE(3,1,0,2));
+    c.v = _mm_sub_ps(_mm_mul_ps(a_yzx,b_zxy),_mm_mul_ps(a_zxy,b_yzx));
+#else
+    c.set(a.v[1]*b.v[2] - a.v[2]*b.v[1],
+          a.v[2]*b.v[0] - a.v[0]*b.v[2],
+          a.v[0]*b.v[1] - a.v[1]*b.v[0]);
+#endif
+    return c;
+  }
+
+  // --------------------
+  // OVERLOADED OPERATORS
+#ifndef SIMD_MATH_SCALAR
+#define SIMD_VEC3_OP(op,intrinsic) \
+  friend SIMDVec3 operator op(const SIMDVec3 &a, const SIMDVec3 &b) { \
+    SIMDVec3 r; r.v = _mm_##intrinsic##_ps(a.v,b.v); return r; }
+#else
+#define SIMD_VEC3_OP(op,intrinsic) \
+  friend SIMDVec3 operator op(const SIMDVec3 &a, const SIMDVec3 &b) { \
+    return SIMDVec3(a.v[0] op b.v[0], a.v[1] op b.v[1], a.v[2] op b.v[2]); }
+#endif
+  SIMD_VEC3_OP(+,add)
+  SIMD_VEC3_OP(-,sub)
+  // component-wise
+  SIMD_VEC3_OP(*,mul)
+#undef SIMD_VEC3_OP
+  friend SIMDVec3 operator*(const SIMDVec3 &a, float s) { return a * SIMDVec3(s,s,s); }
+  friend SIMDVec3 operator*(float s, const SIMDVec3 &a) { return a * SIMDVec3(s,s,s); }
+  friend SIMDVec3 operator-(const SIMDVec3 &a) { return SIMDVec3() - a; }
+  SIMDVec3& operator+=(const SIMDVec3 &a) { *this = *this + a; return *this; }
+  SIMDVec3& operator-=(const SIMDVec3 &a) { *this = *this - a; return *this; }
+
+private:
+
+  friend class SIMDMatrix;
+
+  // REPRESENTATION
+#ifndef SIMD_MATH_SCALAR
+  __m128 v;
+#else
+  alignas(16) float v[4];
+#endif
+};
+
+// ====================================================================
+// ====================================================================
+// A single precision copy of an affine Matrix (column-major, like
+// Matrix), for transforming many points or directions by the same
+// matrix.  The bottom row is assumed to be (0,0,0,1), so unlike
+// Matrix::Transform there is no division by w.
+
+class SIMDMatrix {
+
+public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  SIMDMatrix() {
+    columns[0].set(1,0,0);
+    columns[1].set(0,1,0);
+    columns[2].set(0,0,1);
+    columns[3].set(0,0,0); }
+  explicit SIMDMatrix(const Matrix &m) {
+    assert (fabs(m.get(3,0)) < 1e-6 && fabs(m.get(3,1)) < 1e-6 &&
+            fabs(m.get(3,2)) < 1e-6 && fabs(m.get(3,3)-1) < 1e-6);
+    for (int c = 0; c < 4; c++) {
+      columns[c].set(m.get(0,c),m.get(1,c),m.get(2,c));
+    }
+  }
+
+  // ===============
+  // TRANSFORMATIONS
+  // a point (includes the translation)
+  SIMDVec3 Transform(const SIMDVec3 &p) const {
+    return TransformDirection(p) + columns[3];
+  }
+  // a direction (ignores the translation)
+  SIMDVec3 TransformDirection(const SIMDVec3 &d) const {
+#ifndef SIMD_MATH_SCALAR
+    SIMDVec3 r;
+    __m128 x = _mm_shuffle_ps(d.v,d.v,_MM_SHUFFLE(0,0,0,0));
+    __m128 y = _mm_shuffle_ps(d.v,d.v,_MM_SHUFFLE(1,1,1,1));
+    __m128 z = _mm_shuffle_ps(d.v,d.v,_MM_SHUFFLE(2,2,2,2));
+    r.v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(columns[0].v,x),
+                                _mm_mul_ps(columns[1].v,y)),
+                     _mm_mul_ps(columns[2].v,z));
+    return r;
+#else
+    return columns[0] * d.x() + columns[1] * d.y() + columns[2] * d.z();
+#endif
+  }
+
+private:
+
+  // REPRESENTATION
+  // the first 3 rows of each column
+  SIMDVec3 columns[4];
+};
+
+// ====================================================================
+// ====================================================================
+
+#endif
@@ -7,6 +7,7 @@
 #include "ray.h"
 #include "raytree.h"
 #include "hit.h"
+#include "boundingbox.h"
 #include <math.h>
 
 // ====================================================================
@@ -38,8 +39,11 @@ bool Sphere::intersect(const Ray &r, Hit &h) const {
   Vec3f n;
   Vec3f point;
   
+  // only accept the hit if it is closer than the current closest hit
+  // (the acceleration structure may visit objects in any order)
   if(minus > 0.01)
   {
+    if(minus >= h.getT()) return false;
     point = r.getOrigin() + minus * r.getDirection();
     n = (point - center);
     n *= 1/n.Length();
@@ -48,6 +52,7 @@ bool Sphere::intersect(const Ray &r, Hit &h) const {
   }
   else if(plus > 0.01)
   {
+    if(plus >= h.getT()) return false;
     point = r.getOrigin() + plus * r.getDirection();
     n = (point - center);
     n *= 1/n.Length();
@@ -59,6 +64,24 @@ bool Sphere::intersect(const Ray &r, Hit &h) const {
 
 } 
 
+bool Sphere::occludes(const Ray &r, float tmax) const {
+  Vec3f translation = r.getOrigin() - center;
+  double b = 2 * r.getDirection().Dot3(translation);
+  double c = translation.Dot3(translation) - radius * radius;
+  double d = b * b - 4 * c;
+  if(d < 0) return false;
+  d = sqrt(d);
+  // pick the same root as intersect
+  double t = (-b - d) / 2;
+  if(t <= 0.01) t = (-b + d) / 2;
+  return t > 0.01 && t < tmax;
+}
+
+BoundingBox Sphere::getBoundingBox() const {
+  Vec3f r(radius,radius,radius);
+  return BoundingBox(center-r,center+r);
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -16,8 +16,14 @@ public:
     center = c; radius = r; material = m;
     assert (radius >= 0); }
 
+  // ACCESSORS
+  const Vec3f& getCenter() const { return center; }
+  float getRadius() const { return radius; }
+
   // for ray tracing
   virtual bool intersect(const Ray &r, Hit &h) const;
+  virtual bool occludes(const Ray &r, float tmax) const;
+  virtual BoundingBox getBoundingBox() const;
 
   // for OpenGL rendering & radiosity
   void addRasterizedFaces(Mesh *m, ArgParser *args);
@@ -0,0 +1,530 @@
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <iostream>
+
+#include "tile_renderer.h"
+#include "raytracer.h"
+#include "argparser.h"
+#include "meshdata.h"
+#include "utils.h"
+#include "image.h"
+#include "packet.h"
+#include "hit.h"
+
+// neighboring pixels are traced together, their primary rays are
+// cast as packets (e.g., 2x2 pixels for SSE, 4x2 for AVX)
+#define PACKET_BLOCK_WIDTH (RAY_PACKET_SIZE/2)
+#define PACKET_BLOCK_HEIGHT 2
+// adaptive antialiasing hands out the pixels in chunks of this many
+#define ADAPTIVE_PIXEL_CHUNK 64
+
+// ====================================================================
+// interleave the bits of x & y (each < 2^16)
+
+static inline unsigned int SpreadBits(unsigned int v) {
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+static inline unsigned int MortonCode(unsigned int x, unsigned int y) {
+  return SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+static inline double Clamp01(double v) {
+  if (v < 0) return 0;
+  if (v > 1) return 1;
+  return v;
+}
+
+// [0,1] -> [0,255]
+static inline int ColorToByte(double v) {
+  return int(Clamp01(v)*255 + 0.5);
+}
+
+static double SecondsSince(const std::chrono::steady_clock::time_point &start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// ====================================================================
+
+void PixelEstimate::AddSample(const Vec3f &color) {
+  sum += color;
+  // the luminance as displayed
+  double brightness = 0.2126 * Clamp01(linear_to_srgb(color.r())) +
+                      0.7152 * Clamp01(linear_to_srgb(color.g())) +
+                      0.0722 * Clamp01(linear_to_srgb(color.b()));
+  brightness_sum += brightness;
+  brightness_sq_sum += brightness * brightness;
+  count++;
+}
+
+double PixelEstimate::Error() const {
+  if (count < 2) return 0;
+  double mean = brightness_sum / count;
+  double variance = (brightness_sq_sum - count * mean * mean) / (count - 1);
+  if (variance < 0) variance = 0;
+  return sqrt(variance / count);
+}
+
+// ====================================================================
+
+bool TileRenderer::isAdaptive() const {
+  return args->mesh_data->adaptive_max_samples > 0;
+}
+
+void TileRenderer::Reset() {
+  divs_x = 0;
+  divs_y = 0;
+  tiles_x = 0;
+  tiles_y = 0;
+  tile_order.clear();
+  next_tile = 0;
+  accumulating = false;
+  estimates.clear();
+  previous.clear();
+  previous_divs_x = 0;
+  previous_divs_y = 0;
+}
+
+// ====================================================================
+
+void TileRenderer::StartPass(int dx, int dy, bool keep_estimates) {
+  assert (dx < (1<<16));
+  previous.swap(estimates);
+  previous_divs_x = divs_x;
+  previous_divs_y = divs_y;
+  estimates.assign(keep_estimates ? dx*dy : 0, PixelEstimate());
+  divs_x = dx;
+  divs_y = dy;
+  tiles_x = (divs_x + TILE_SIZE - 1) / TILE_SIZE;
+  tiles_y = (divs_y + TILE_SIZE - 1) / TILE_SIZE;
+
+  // walk the tiles along the Z-curve
+  std::vector<std::pair<unsigned int,int> > codes;
+  codes.reserve(tiles_x * tiles_y);
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      codes.push_back(std::make_pair(MortonCode(tx,ty), ty*tiles_x+tx));
+    }
+  }
+  std::sort(codes.begin(),codes.end());
+  tile_order.clear();
+  for (unsigned int i = 0; i < codes.size(); i++) {
+    tile_order.push_back(codes[i].second);
+  }
+  next_tile = 0;
+}
+
+// The previous pass is complete.  Decrease the pixel size & start
+// over again.  At the resolution of the camera, go over the image
+// again to add more samples to each pixel (or stop, once there are
+// enough).
+bool TileRenderer::NextPass() {
+  if (isFullResolution()) {
+    if (!MoreAccumulationWanted()) return false;
+    accumulating = true;
+    next_tile = 0;
+  } else {
+    int width = args->mesh_data->width;
+    int height = args->mesh_data->height;
+    int dx = divs_x * 3;
+    int dy = divs_y * 3;
+    if (dx > width * 0.51 || dx > height * 0.51) {
+      dx = width;
+      dy = height;
+    }
+    StartPass(dx,dy,true);
+  }
+
+  // draw the new pass on top of the old one (which stays visible
+  // until it is covered)
+  if (raytracer->render_to_a) {
+    raytracer->pixels_b.clear();
+    raytracer->render_to_a = false;
+  } else {
+    raytracer->pixels_a.clear();
+    raytracer->render_to_a = true;
+  }
+  return true;
+}
+
+bool TileRenderer::isFullResolution() const {
+  return divs_x >= args->mesh_data->width || divs_y >= args->mesh_data->height;
+}
+
+// (every pixel has the same number of samples, adaptive antialiasing
+// decides on its own when a pixel is done)
+bool TileRenderer::MoreAccumulationWanted() const {
+  if (isAdaptive() || estimates.empty()) return false;
+  return estimates[0].count < args->mesh_data->progressive_samples;
+}
+
+int TileRenderer::TilePixelCount(int tile) const {
+  int tx = tile % tiles_x;
+  int ty = tile / tiles_x;
+  int w = std::min(TILE_SIZE, divs_x - tx*TILE_SIZE);
+  int h = std::min(TILE_SIZE, divs_y - ty*TILE_SIZE);
+  return w*h;
+}
+
+// ====================================================================
+
+bool TileRenderer::RenderTiles(int num_pixels) {
+  if (divs_x == 0) {
+    // first pass, as requested by the user interface
+    int dx = std::max(1,std::min(args->mesh_data->raytracing_divs_x,args->mesh_data->width));
+    int dy = std::max(1,std::min(args->mesh_data->raytracing_divs_y,args->mesh_data->height));
+    StartPass(dx,dy,true);
+  }
+
+  while (num_pixels > 0) {
+    if (next_tile >= (int)tile_order.size()) {
+      if (!NextPass()) return false;
+    }
+    // grab enough tiles from the current pass to use up the budget
+    int first = next_tile;
+    int last = first;
+    while (last < (int)tile_order.size() && num_pixels > 0) {
+      num_pixels -= TilePixelCount(tile_order[last]);
+      last++;
+    }
+    RenderBatch(first,last,NULL);
+    next_tile = last;
+  }
+
+  if (next_tile >= (int)tile_order.size() && isFullResolution() && !MoreAccumulationWanted()) {
+    return false;
+  }
+  return true;
+}
+
+void TileRenderer::RenderImage(Image &image) {
+  int width = args->mesh_data->width;
+  int height = args->mesh_data->height;
+  image.Allocate(width,height);
+  Reset();
+  StartPass(width,height,false);
+  if (isAdaptive()) {
+    RenderImageAdaptive(image);
+  } else {
+    RenderBatch(0,tile_order.size(),&image);
+  }
+  next_tile = tile_order.size();
+}
+
+// call f(0) ... f(n-1) on all of the threads, handing out chunks of
+// consecutive indices
+void TileRenderer::ParallelFor(int n, int chunk, const std::function<void(int)> &f) const {
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    int first;
+    while ((first = next.fetch_add(chunk)) < n) {
+      int last = std::min(first + chunk, n);
+      for (int i = first; i < last; i++) {
+        f(i);
+      }
+    }
+    RayTracer::FlushRayCount();
+  };
+
+  int num_threads = std::min(args->numThreads(),(n + chunk - 1) / chunk);
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+// render the tiles [first,last) of the current pass, in parallel
+// (into the image, if there is one, otherwise into the next batch of
+// quads for the interactive display)
+void TileRenderer::RenderBatch(int first, int last, Image *image) {
+  std::vector<std::vector<Pixel> > results(last-first);
+  ParallelFor(last-first,1,[&](int i) {
+      RenderTile(tile_order[first+i],results[i],image); });
+
+  if (image != NULL) return;
+
+  // collect the pixels in tile order
+  std::vector<Pixel> &pixels = raytracer->render_to_a ? raytracer->pixels_a : raytracer->pixels_b;
+  for (unsigned int i = 0; i < results.size(); i++) {
+    pixels.insert(pixels.end(),results[i].begin(),results[i].end());
+  }
+}
+
+// Trace the center of each cell of the tile (bottom row first) in
+// small blocks of cells.  The primary rays of a block are cast
+// together, then each ray is shaded on its own.
+void TileRenderer::RenderTile(int tile, std::vector<Pixel> &pixels, Image *image) {
+  int x0 = (tile % tiles_x) * TILE_SIZE;
+  int y0 = (tile / tiles_x) * TILE_SIZE;
+  int x1 = std::min(x0 + TILE_SIZE, divs_x);
+  int y1 = std::min(y0 + TILE_SIZE, divs_y);
+  double x_spacing = args->mesh_data->width / double (divs_x);
+  double y_spacing = args->mesh_data->height / double (divs_y);
+  int bounces = args->mesh_data->num_bounces;
+  int portal_depth = args->mesh_data->portal_recursion_depth;
+  if (image == NULL) pixels.reserve((x1-x0)*(y1-y0));
+
+  if (accumulating) {
+    // more (jittered) samples for each pixel of the full resolution image
+    int count = std::max(1,args->mesh_data->num_antialias_samples);
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        PixelEstimate &e = estimates[y*divs_x + x];
+        int more = std::min(count, args->mesh_data->progressive_samples - e.count);
+        if (more > 0) SamplePixel(x,y,more,e);
+        StorePixel(x,y,e.Mean(),pixels,image);
+      }
+    }
+    return;
+  }
+
+  if (isAdaptive()) {
+    // keep adding samples to each cell until it has converged
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        PixelEstimate scratch;
+        PixelEstimate &e = CellEstimate(x,y,scratch);
+        if (!ReuseCell(x,y,e)) {
+          StartPixel(x,y,e);
+          SamplePixel(x,y,args->mesh_data->adaptive_min_samples,e);
+        }
+        int more;
+        while ((more = MoreSamplesWanted(e)) > 0) {
+          SamplePixel(x,y,more,e);
+        }
+        StorePixel(x,y,e.Mean(),pixels,image);
+      }
+    }
+    return;
+  }
+
+  std::vector<Ray> rays;
+  std::vector<Ray> pixel_rays;
+  std::vector<Hit> hits;
+  std::vector<bool> answers;
+  std::vector<int> portals;
+  for (int by = y0; by < y1; by += PACKET_BLOCK_HEIGHT) {
+    for (int bx = x0; bx < x1; bx += PACKET_BLOCK_WIDTH) {
+      int bx1 = std::min(bx + PACKET_BLOCK_WIDTH, x1);
+      int by1 = std::min(by + PACKET_BLOCK_HEIGHT, y1);
+
+      // the primary rays of the block (the same rays, and the same
+      // random numbers, as VisualizeTraceRay would use for each cell)
+      RandomGenerator states[PACKET_BLOCK_WIDTH*PACKET_BLOCK_HEIGHT];
+      PixelEstimate scratch[PACKET_BLOCK_WIDTH*PACKET_BLOCK_HEIGHT];
+      PixelEstimate *cells[PACKET_BLOCK_WIDTH*PACKET_BLOCK_HEIGHT];
+      bool reused[PACKET_BLOCK_WIDTH*PACKET_BLOCK_HEIGHT];
+      int first_ray[PACKET_BLOCK_WIDTH*PACKET_BLOCK_HEIGHT+1];
+      int num_cells = 0;
+      rays.clear();
+      for (int y = by; y < by1; y++) {
+        for (int x = bx; x < bx1; x++, num_cells++) {
+          cells[num_cells] = &CellEstimate(x,y,scratch[num_cells]);
+          first_ray[num_cells] = rays.size();
+          reused[num_cells] = ReuseCell(x,y,*cells[num_cells]);
+          if (reused[num_cells]) continue;
+          // every cell of every pass has its own random numbers (the
+          // passes have different widths)
+          args->SeedRandom(RANDOM_STREAM_PIXEL, (uint64_t(divs_x) << 40) | uint64_t(y*divs_x + x));
+          GeneratePixelRays((x+0.5)*x_spacing, (y+0.5)*y_spacing, pixel_rays);
+          states[num_cells] = args->getRandomGenerator();
+          rays.insert(rays.end(),pixel_rays.begin(),pixel_rays.end());
+        }
+      }
+      first_ray[num_cells] = rays.size();
+      raytracer->CastRays(rays,hits,answers,portals,false,portal_depth > 0);
+
+      int cell = 0;
+      for (int y = by; y < by1; y++) {
+        for (int x = bx; x < bx1; x++, cell++) {
+          PixelEstimate &e = *cells[cell];
+          if (!reused[cell]) {
+            args->setRandomGenerator(states[cell]);
+            for (int k = first_ray[cell]; k < first_ray[cell+1]; k++) {
+              e.AddSample(raytracer->ShadeRay(rays[k],hits[k],answers[k],portals[k],bounces,portal_depth));
+            }
+            e.random = args->getRandomGenerator();
+          }
+          StorePixel(x,y,e.Mean(),pixels,image);
+        }
+      }
+    }
+  }
+}
+
+// where the samples of cell (x,y) are kept: for the following passes,
+// or (when they aren't kept) in the scratch estimate
+PixelEstimate& TileRenderer::CellEstimate(int x, int y, PixelEstimate &scratch) {
+  if (estimates.empty()) return scratch;
+  return estimates[y*divs_x + x];
+}
+
+// The middle cell of each 3x3 block has the same center as the cell
+// of the previous pass the block replaces, and its rays have the same
+// distribution, so it continues with the samples traced for that cell.
+bool TileRenderer::ReuseCell(int x, int y, PixelEstimate &e) const {
+  if (previous.empty() || divs_x != 3*previous_divs_x || divs_y != 3*previous_divs_y) return false;
+  if (x % 3 != 1 || y % 3 != 1) return false;
+  e = previous[(y/3)*previous_divs_x + x/3];
+  return true;
+}
+
+// the color of cell (x,y) of the current pass goes into the image
+// (if there is one), or onto the list of quads for visualization
+void TileRenderer::StorePixel(int x, int y, const Vec3f &color,
+                              std::vector<Pixel> &pixels, Image *image) const {
+  Vec3f srgb(linear_to_srgb(color.r()),
+             linear_to_srgb(color.g()),
+             linear_to_srgb(color.b()));
+
+  if (image != NULL) {
+    // each pixel belongs to exactly one tile, no locking needed
+    image->SetPixel(x,y,Color(ColorToByte(srgb.r()),
+                              ColorToByte(srgb.g()),
+                              ColorToByte(srgb.b())));
+    return;
+  }
+
+  // the position of the cell, for visualization
+  double x_spacing = args->mesh_data->width / double (divs_x);
+  double y_spacing = args->mesh_data->height / double (divs_y);
+  Pixel p;
+  p.v1 = PixelGetPos((x  )*x_spacing, (y  )*y_spacing);
+  p.v2 = PixelGetPos((x+1)*x_spacing, (y  )*y_spacing);
+  p.v3 = PixelGetPos((x+1)*x_spacing, (y+1)*y_spacing);
+  p.v4 = PixelGetPos((x  )*x_spacing, (y+1)*y_spacing);
+  p.color = srgb;
+  pixels.push_back(p);
+}
+
+// ====================================================================
+// ADAPTIVE ANTIALIASING
+
+// every cell of every pass has its own random numbers (the passes
+// have different widths), the same as without adaptive antialiasing
+void TileRenderer::StartPixel(int x, int y, PixelEstimate &e) const {
+  args->SeedRandom(RANDOM_STREAM_PIXEL, (uint64_t(divs_x) << 40) | uint64_t(y*divs_x + x));
+  e.random = args->getRandomGenerator();
+  e.sum = Vec3f(0,0,0);
+  e.brightness_sum = 0;
+  e.brightness_sq_sum = 0;
+  e.count = 0;
+}
+
+// trace count more samples of cell (x,y), continuing its random numbers
+void TileRenderer::SamplePixel(int x, int y, int count, PixelEstimate &e) const {
+  double x_spacing = args->mesh_data->width / double (divs_x);
+  double y_spacing = args->mesh_data->height / double (divs_y);
+  int bounces = args->mesh_data->num_bounces;
+  int portal_depth = args->mesh_data->portal_recursion_depth;
+
+  std::vector<Ray> rays;
+  std::vector<Hit> hits;
+  std::vector<bool> answers;
+  std::vector<int> portals;
+  args->setRandomGenerator(e.random);
+  GeneratePixelRays((x+0.5)*x_spacing, (y+0.5)*y_spacing, e.count, count, rays);
+  raytracer->CastRays(rays,hits,answers,portals,false,portal_depth > 0);
+  for (unsigned int k = 0; k < rays.size(); k++) {
+    e.AddSample(raytracer->ShadeRay(rays[k],hits[k],answers[k],portals[k],bounces,portal_depth));
+  }
+  e.random = args->getRandomGenerator();
+}
+
+// the number of samples to add to the pixel next (0 once it has
+// converged or reached the maximum), doubling the count each time
+int TileRenderer::MoreSamplesWanted(const PixelEstimate &e) const {
+  int max_samples = args->mesh_data->adaptive_max_samples;
+  if (e.count >= max_samples) return 0;
+  if (e.Error() <= args->mesh_data->antialias_threshold) return 0;
+  return std::min(e.count, max_samples - e.count);
+}
+
+// Batch rendering refines the whole image in rounds.  Each round the
+// pixels that are still too noisy get more samples, noisiest first,
+// until all have converged or the sample or time budget is used up.
+// (The result only depends on the time budget, not on the threads.)
+void TileRenderer::RenderImageAdaptive(Image &image) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int width = args->mesh_data->width;
+  int height = args->mesh_data->height;
+  double time_budget = args->mesh_data->time_budget;
+  long long sample_budget = -1;
+  if (args->mesh_data->sample_budget > 0) {
+    sample_budget = (long long)(args->mesh_data->sample_budget * width * height);
+  }
+
+  // the pixels tile by tile, so neighbors are traced together
+  std::vector<int> order;
+  order.reserve(width*height);
+  for (unsigned int t = 0; t < tile_order.size(); t++) {
+    int x0 = (tile_order[t] % tiles_x) * TILE_SIZE;
+    int y0 = (tile_order[t] / tiles_x) * TILE_SIZE;
+    for (int y = y0; y < std::min(y0 + TILE_SIZE, height); y++) {
+      for (int x = x0; x < std::min(x0 + TILE_SIZE, width); x++) {
+        order.push_back(y*width + x);
+      }
+    }
+  }
+
+  // every pixel gets the minimum number of samples
+  std::vector<PixelEstimate> estimates(width*height);
+  int min_samples = args->mesh_data->adaptive_min_samples;
+  ParallelFor(order.size(),ADAPTIVE_PIXEL_CHUNK,[&](int k) {
+      int p = order[k];
+      StartPixel(p % width, p / width, estimates[p]);
+      SamplePixel(p % width, p / width, min_samples, estimates[p]); });
+  long long total = (long long)min_samples * width * height;
+
+  int rounds = 0;
+  while (time_budget <= 0 || SecondsSince(start) < time_budget) {
+    // the pixels that are still too noisy, the noisiest first
+    std::vector<std::pair<double,int> > todo;
+    for (unsigned int k = 0; k < order.size(); k++) {
+      const PixelEstimate &e = estimates[order[k]];
+      if (MoreSamplesWanted(e) > 0) todo.push_back(std::make_pair(-e.Error(),order[k]));
+    }
+    std::sort(todo.begin(),todo.end());
+    // as many of them as the sample budget allows
+    unsigned int num = 0;
+    while (num < todo.size()) {
+      int more = MoreSamplesWanted(estimates[todo[num].second]);
+      if (sample_budget >= 0 && total + more > sample_budget) break;
+      total += more;
+      num++;
+    }
+    if (num == 0) break;
+    rounds++;
+    ParallelFor(num,ADAPTIVE_PIXEL_CHUNK,[&](int k) {
+        if (time_budget > 0 && SecondsSince(start) >= time_budget) return;
+        int p = todo[k].second;
+        SamplePixel(p % width, p / width, MoreSamplesWanted(estimates[p]), estimates[p]); });
+  }
+
+  std::vector<Pixel> unused;
+  long long samples = 0;
+  int most = 0;
+  for (int p = 0; p < width*height; p++) {
+    StorePixel(p % width, p / width, estimates[p].Mean(), unused, &image);
+    samples += estimates[p].count;
+    most = std::max(most,estimates[p].count);
+  }
+  std::cout << "adaptive antialiasing: " << samples / double(width*height)
+            << " samples per pixel on average (" << min_samples << " to " << most
+            << "), " << rounds << " refinement rounds" << std::endl;
+}
+
+// ====================================================================
+// ====================================================================
@@ -0,0 +1,137 @@
+#ifndef _TILE_RENDERER_H_
+#define _TILE_RENDERER_H_
+
+#include <vector>
+#include <functional>
+#include "vectors.h"
+#include "random.h"
+
+class ArgParser;
+class RayTracer;
+class Pixel;
+class Image;
+
+// the image is split into square tiles of this many (coarse) pixels
+#define TILE_SIZE 16
+// the number of pixels each thread traces between screen refreshes
+#define RAYTRACE_PIXELS_PER_THREAD 10000
+
+// ====================================================================
+// The running estimate of one pixel for adaptive antialiasing: the sum
+// of the sample colors, the mean & variance of their (displayed)
+// brightness, and the random numbers to continue sampling it with.
+
+struct PixelEstimate {
+  PixelEstimate() : brightness_sum(0), brightness_sq_sum(0), count(0) {}
+
+  Vec3f sum;
+  double brightness_sum;
+  double brightness_sq_sum;
+  int count;
+  RandomGenerator random;
+
+  void AddSample(const Vec3f &color);
+  Vec3f Mean() const { return sum * (1.0 / count); }
+  // the standard error of the mean brightness
+  double Error() const;
+};
+
+// ====================================================================
+// ====================================================================
+// Progressive, multi-threaded rendering of the ray traced image.
+// Each pass samples the image on a grid of divs_x x divs_y cells,
+// starting coarse and refining by a factor of 3 until every pixel
+// has been traced.  The center of a cell is the center of the middle
+// one of its 3x3 cells in the next pass (and the antialiasing jitter
+// is relative to the final pixel size), so the middle cells take over
+// the samples of the previous pass rather than tracing them again.
+// Once the full resolution is reached, more passes keep adding
+// samples to every pixel, up to progressive_samples per pixel.
+// A pass is cut into tiles which are handed out to
+// the worker threads in Morton (Z-curve) order, so neighboring rays
+// (which touch the same part of the scene) are traced close together
+// in time.  The results only depend on the tile, never on which
+// thread rendered it or in what order the tiles finished.
+//
+// With adaptive antialiasing every pixel starts with a few samples,
+// and more are added only while the standard error of its brightness
+// is above the threshold (up to a maximum).  Batch rendering refines
+// the image in rounds, noisiest pixels first, and also honors a
+// global sample and/or time budget.
+
+class TileRenderer {
+
+public:
+
+  // ========================
+  // CONSTRUCTOR & DESTRUCTOR
+  TileRenderer(RayTracer *r, ArgParser *a) { raytracer = r; args = a; Reset(); }
+
+  // =========
+  // ACCESSORS
+  int getDivsX() const { return divs_x; }
+  int getDivsY() const { return divs_y; }
+  int numTiles() const { return tile_order.size(); }
+  bool isAdaptive() const;
+
+  // =========
+  // MODIFIERS
+  // the next call to RenderTiles starts over with the coarsest pass
+  // (read from the raytracing_divs_x/y of the MeshData)
+  void Reset();
+  // render (at least) num_pixels cells, spread across all of the
+  // threads, continuing the current pass or starting the next one.
+  // Returns false once the last pass is complete.
+  bool RenderTiles(int num_pixels);
+  // render every pixel of the image in a single full resolution pass
+  // (for batch mode, no progressive refinement of the resolution)
+  void RenderImage(Image &image);
+  // call f(0) ... f(n-1) on all of the threads, in chunks
+  void ParallelFor(int n, int chunk, const std::function<void(int)> &f) const;
+
+private:
+
+  // HELPER FUNCTIONS
+  void StartPass(int dx, int dy, bool keep_estimates);
+  bool NextPass();
+  bool isFullResolution() const;
+  bool MoreAccumulationWanted() const;
+  int TilePixelCount(int tile) const;
+  void RenderBatch(int first, int last, Image *image);
+  void RenderTile(int tile, std::vector<Pixel> &pixels, Image *image);
+  PixelEstimate& CellEstimate(int x, int y, PixelEstimate &scratch);
+  bool ReuseCell(int x, int y, PixelEstimate &e) const;
+  void StorePixel(int x, int y, const Vec3f &color, std::vector<Pixel> &pixels, Image *image) const;
+  // adaptive antialiasing
+  void RenderImageAdaptive(Image &image);
+  void StartPixel(int x, int y, PixelEstimate &e) const;
+  void SamplePixel(int x, int y, int count, PixelEstimate &e) const;
+  int MoreSamplesWanted(const PixelEstimate &e) const;
+
+  // REPRESENTATION
+  RayTracer *raytracer;
+  ArgParser *args;
+
+  // the current pass
+  int divs_x;
+  int divs_y;
+  int tiles_x;
+  int tiles_y;
+  // tile indices (ty*tiles_x+tx) sorted along the Morton curve
+  std::vector<int> tile_order;
+  int next_tile;
+  // adding samples to the full resolution image
+  bool accumulating;
+
+  // the samples of each cell (y*divs_x+x) of the current & the
+  // previous pass (not kept when rendering straight into an image)
+  std::vector<PixelEstimate> estimates;
+  std::vector<PixelEstimate> previous;
+  int previous_divs_x;
+  int previous_divs_y;
+};
+
+// ====================================================================
+// ====================================================================
+
+#endif